@@ -0,0 +1,412 @@
+/*
+ * Micro-benchmarks for the per buffer parsing and packetizing helpers
+ *
+ * Runs each helper from parse.c (and pes_set_pts from common.c) over a set
+ * of synthetic frames, or for the scanning helpers over the frames of a
+ * recorded elementary stream given with -f, and prints one line of space
+ * separated key=value pairs per helper, with ns per byte and ns per frame.
+ * Synthetic frames contain none of the codes the scans look for, so they
+ * measure a scan over the whole frame. The *_bytewise cases are the byte by
+ * byte searches find_sync replaced, for comparison.
+ *
+ * usage: bench-parsers [-f file] [frames] [size]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <gst/gst.h>
+
+#include "common.h"
+#include "parse.h"
+
+/* run every benchmark for at least this long, in seconds */
+#define BENCH_MIN_TIME 0.25
+
+typedef struct bench
+{
+	/* frames of size bytes each, synthetic or read from a file */
+	guint8 *input;
+	/* the same frames as AVCC, with 2 and with 4 byte length fields */
+	guint8 *avc2;
+	guint8 *avc4;
+	/* scratch space for the functions that write */
+	guint8 *work;
+	write_segment_t *segments;
+	int max_segments;
+	GstBuffer *startcode;
+	int frames;
+	size_t size;
+	const char *source;
+} bench_t;
+
+/* keeps the compiler from optimizing the benchmarked calls away */
+static volatile size_t result;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *func, const char *source, double seconds, guint64 frames, guint64 bytes)
+{
+	printf("func=%s input=%s frames=%llu bytes=%llu ns_per_byte=%.3f ns_per_frame=%.1f\n",
+		func, source, (unsigned long long)frames, (unsigned long long)bytes,
+		seconds * 1e9 / bytes, seconds * 1e9 / frames);
+}
+
+/* slices of about 1400 bytes, like in bench-sinks */
+static void fill_avc(guint8 *data, size_t size, int len_size)
+{
+	size_t pos = 0;
+	memset(data, 0x55, size);
+	while (pos < size)
+	{
+		size_t nal_len = MIN(1400, size - pos - len_size);
+		int i;
+		for (i = 0; i < len_size; i++)
+		{
+			data[pos + i] = nal_len >> (8 * (len_size - 1 - i));
+		}
+		data[pos + len_size] = 0x41;
+		pos += len_size + nal_len;
+	}
+}
+
+typedef size_t (*bench_func_t)(bench_t *b, guint8 *frame);
+
+/* time func over all frames, repeatedly, prepare is called before every pass, untimed */
+static void run(bench_t *b, const char *name, const char *source, guint8 *frames, bench_func_t func, void (*prepare)(bench_t *b))
+{
+	double elapsed = 0;
+	guint64 count = 0, bytes = 0;
+
+	while (elapsed < BENCH_MIN_TIME)
+	{
+		double start;
+		int i;
+		if (prepare) prepare(b);
+		start = now();
+		for (i = 0; i < b->frames; i++)
+		{
+			bytes += func(b, frames + i * b->size);
+		}
+		elapsed += now() - start;
+		count += b->frames;
+	}
+	report(name, source, elapsed, count, bytes);
+}
+
+/* the conversions h264_nal_len_to_segments replaced, to compare against */
+
+/* replace the length fields of the AVCC NAL units in data by start codes,
+ * in place, so the length fields must be at least 3 bytes */
+static void h264_nal_len_to_startcode(unsigned char *data, size_t len, int nal_len_size)
+{
+	unsigned int pos = 0;
+	while (1)
+	{
+		unsigned int pack_len = 0;
+		int i;
+		for (i = 0; i < nal_len_size; i++, pos++)
+		{
+			pack_len <<= 8;
+			pack_len += data[pos];
+			/* replace the lenght field with \x00..\x00\x01 */
+			data[pos] = (i == nal_len_size - 1) ? 1 : 0;
+		}
+		if ((pos + pack_len) >= len) break;
+		pos += pack_len;
+	}
+}
+
+/* the number of bytes h264_nal_len_to_startcode_copy makes of data */
+static size_t h264_nal_len_to_startcode_size(const unsigned char *data, size_t len, int nal_len_size)
+{
+	size_t pos = 0, size = 0;
+	while (pos + nal_len_size <= len)
+	{
+		size_t nal_len = 0;
+		int i;
+		for (i = 0; i < nal_len_size; i++, pos++)
+		{
+			nal_len = (nal_len << 8) | data[pos];
+		}
+		if (nal_len > len - pos) nal_len = len - pos;
+		if (!nal_len) continue;
+		size += 3 + nal_len;
+		pos += nal_len;
+	}
+	return size;
+}
+
+/* copy the AVCC NAL units in data to dest, with 3 byte start codes instead
+ * of the length fields. A length running past the end of data is cut short,
+ * and nothing is written past dest_size. Returns the number of bytes in dest */
+static size_t h264_nal_len_to_startcode_copy(const unsigned char *data, size_t len, int nal_len_size, unsigned char *dest, size_t dest_size)
+{
+	size_t pos = 0, dest_pos = 0;
+	while (pos + nal_len_size <= len)
+	{
+		size_t nal_len = 0;
+		int i;
+		for (i = 0; i < nal_len_size; i++, pos++)
+		{
+			nal_len = (nal_len << 8) | data[pos];
+		}
+		if (nal_len > len - pos) nal_len = len - pos;
+		if (!nal_len) continue;
+		if (dest_pos + 3 + nal_len > dest_size) break;
+		memcpy(dest + dest_pos, "\x00\x00\x01", 3);
+		dest_pos += 3;
+		memcpy(dest + dest_pos, data + pos, nal_len);
+		dest_pos += nal_len;
+		pos += nal_len;
+	}
+	return dest_pos;
+}
+
+static void prepare_avc4(bench_t *b)
+{
+	int i;
+	for (i = 0; i < b->frames; i++)
+	{
+		fill_avc(b->avc4 + i * b->size, b->size, 4);
+	}
+}
+
+static size_t bench_h264_inplace(bench_t *b, guint8 *frame)
+{
+	h264_nal_len_to_startcode(frame, b->size, 4);
+	return b->size;
+}
+
+static size_t bench_h264_copy(bench_t *b, guint8 *frame)
+{
+	size_t size = h264_nal_len_to_startcode_size(frame, b->size, 2);
+	result += h264_nal_len_to_startcode_copy(frame, b->size, 2, b->work, size);
+	return b->size;
+}
+
+static size_t bench_h264_segments(bench_t *b, guint8 *frame)
+{
+	result += h264_nal_len_to_segments(NULL, frame, b->size, 4, b->startcode, b->segments, b->max_segments);
+	return b->size;
+}
+
+/* the byte by byte searches find_sync replaced, to compare against */
+static size_t find_bytewise(const unsigned char *data, size_t len, const void *pattern, int pattern_len)
+{
+	size_t pos;
+	for (pos = 0; pos + pattern_len <= len; pos++)
+	{
+		if (!memcmp(data + pos, pattern, pattern_len)) return pos;
+	}
+	return len;
+}
+
+static size_t bench_startcode(bench_t *b, guint8 *frame)
+{
+	size_t pos = 0;
+	/* every start code in the frame, like the VOP walk does */
+	while (pos < b->size)
+	{
+		pos += find_sync(frame + pos, b->size - pos, "\x00\x00\x01", 3) + 3;
+		result += pos;
+	}
+	return b->size;
+}
+
+static size_t bench_startcode_bytewise(bench_t *b, guint8 *frame)
+{
+	size_t pos = 0;
+	while (pos < b->size)
+	{
+		pos += find_bytewise(frame + pos, b->size - pos, "\x00\x00\x01", 3) + 3;
+		result += pos;
+	}
+	return b->size;
+}
+
+static size_t bench_mpeg2_group_start_bytewise(bench_t *b, guint8 *frame)
+{
+	result += find_bytewise(frame, b->size, "\x00\x00\x01\xb8", 4);
+	return b->size;
+}
+
+static size_t bench_dts_hd_sync_bytewise(bench_t *b, guint8 *frame)
+{
+	result += find_bytewise(frame, b->size, "\x64\x58\x20\x25", 4);
+	return b->size;
+}
+
+static size_t bench_mpeg2_group_start(bench_t *b, guint8 *frame)
+{
+	result += mpeg2_find_group_start(frame, b->size);
+	return b->size;
+}
+
+static size_t bench_dts_hd_sync(bench_t *b, guint8 *frame)
+{
+	result += dts_find_hd_sync(frame, b->size);
+	return b->size;
+}
+
+static size_t bench_dts_sync(bench_t *b, guint8 *frame)
+{
+	static const unsigned char sync[4] = { 0x7f, 0xfe, 0x80, 0x01 };
+	result += dts_find_sync(frame, b->size, sync);
+	return b->size;
+}
+
+/* fields of 1 to 16 bits, like a header parser reads them */
+static size_t bench_bitstream_get(bench_t *b, guint8 *frame)
+{
+	struct bitstream bit;
+	size_t bits = 0, total = (b->size - 4) * 8;
+	unsigned long sum = 0;
+	int width = 1;
+	bitstream_init(&bit, frame, 0);
+	while (bits + width <= total)
+	{
+		sum += bitstream_get(&bit, width);
+		bits += width;
+		width = width % 16 + 1;
+	}
+	result += sum;
+	return bits / 8;
+}
+
+static size_t bench_bitstream_put(bench_t *b, guint8 *frame)
+{
+	struct bitstream bit;
+	size_t bits = 0, total = (b->size - 4) * 8;
+	int width = 1;
+	bitstream_init(&bit, b->work, 1);
+	while (bits + width <= total)
+	{
+		bitstream_put(&bit, frame[bits / 8], width);
+		bits += width;
+		width = width % 16 + 1;
+	}
+	return bits / 8;
+}
+
+static void bench_pes_set_pts(bench_t *b)
+{
+	unsigned char header[14];
+	double elapsed = 0;
+	guint64 count = 0;
+	int calls = b->frames * 64;
+
+	while (elapsed < BENCH_MIN_TIME)
+	{
+		double start = now();
+		int i;
+		for (i = 0; i < calls; i++)
+		{
+			pes_set_pts(i * 40 * GST_MSECOND, header);
+			result += header[13];
+		}
+		elapsed += now() - start;
+		count += calls;
+	}
+	/* a frame is a call here, writing the 5 PTS bytes */
+	report("pes_set_pts", "synthetic", elapsed, count, count * 5);
+}
+
+int main(int argc, char *argv[])
+{
+	bench_t b;
+	const char *file = NULL;
+	int opt, i;
+
+	gst_init(&argc, &argv);
+
+	b.frames = 1024;
+	b.size = 16384;
+	while ((opt = getopt(argc, argv, "f:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-f file] [frames] [size]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) b.frames = atoi(argv[optind]);
+	if (optind + 1 < argc) b.size = atoi(argv[optind + 1]);
+	if (b.frames < 1 || b.size < 64)
+	{
+		fprintf(stderr, "need at least 1 frame of 64 bytes\n");
+		return 1;
+	}
+
+	b.input = g_malloc(b.frames * b.size);
+	b.avc2 = g_malloc(b.frames * b.size);
+	b.avc4 = g_malloc(b.frames * b.size);
+	/* the 2 byte AVCC copy grows by a byte per slice */
+	b.work = g_malloc(b.size * 2);
+	/* a start code and a NAL unit per slice */
+	b.max_segments = 2 * (b.size / 1400 + 1);
+	b.segments = g_new(write_segment_t, b.max_segments);
+	b.startcode = h264_startcode_buffer_new();
+	b.source = "synthetic";
+	memset(b.input, 0x55, b.frames * b.size);
+	if (file)
+	{
+		FILE *f = fopen(file, "rb");
+		size_t rd;
+		if (!f)
+		{
+			perror(file);
+			return 1;
+		}
+		rd = fread(b.input, 1, b.frames * b.size, f);
+		fclose(f);
+		if (rd < b.size)
+		{
+			fprintf(stderr, "%s: less than one frame of data\n", file);
+			return 1;
+		}
+		b.frames = rd / b.size;
+		b.source = "recorded";
+	}
+	for (i = 0; i < b.frames; i++)
+	{
+		fill_avc(b.avc2 + i * b.size, b.size, 2);
+	}
+
+	bench_pes_set_pts(&b);
+	run(&b, "h264_nal_len_to_startcode", "synthetic", b.avc4, bench_h264_inplace, prepare_avc4);
+	run(&b, "h264_nal_len_to_startcode_copy", "synthetic", b.avc2, bench_h264_copy, NULL);
+	run(&b, "h264_nal_len_to_segments", "synthetic", b.avc4, bench_h264_segments, prepare_avc4);
+	run(&b, "find_sync_startcode", b.source, b.input, bench_startcode, NULL);
+	run(&b, "find_sync_startcode_bytewise", b.source, b.input, bench_startcode_bytewise, NULL);
+	run(&b, "mpeg2_find_group_start", b.source, b.input, bench_mpeg2_group_start, NULL);
+	run(&b, "mpeg2_find_group_start_bytewise", b.source, b.input, bench_mpeg2_group_start_bytewise, NULL);
+	run(&b, "bitstream_get", b.source, b.input, bench_bitstream_get, NULL);
+	run(&b, "bitstream_put", b.source, b.input, bench_bitstream_put, NULL);
+	run(&b, "dts_find_hd_sync", b.source, b.input, bench_dts_hd_sync, NULL);
+	run(&b, "dts_find_hd_sync_bytewise", b.source, b.input, bench_dts_hd_sync_bytewise, NULL);
+	run(&b, "dts_find_sync", b.source, b.input, bench_dts_sync, NULL);
+
+	gst_buffer_unref(b.startcode);
+	g_free(b.segments);
+	g_free(b.work);
+	g_free(b.avc4);
+	g_free(b.avc2);
+	g_free(b.input);
+	return 0;
+}
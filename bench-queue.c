@@ -0,0 +1,81 @@
+/*
+ * Microbenchmark for the write queue in common.c
+ *
+ * Pushes and drains a number of entries (100000 by default) a few times
+ * and reports the time per operation. The first round includes filling
+ * the entry pool, the following rounds run from the recycled entries.
+ *
+ * usage: bench-queue [entries] [rounds]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <gst/gst.h>
+
+#include "common.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	int entries = 100000;
+	int rounds = 5;
+	int round;
+	queue_t queue;
+	GstBuffer *buffer;
+
+	gst_init(&argc, &argv);
+
+	if (argc > 1) entries = atoi(argv[1]);
+	if (argc > 2) rounds = atoi(argv[2]);
+	if (entries <= 0 || rounds <= 0)
+	{
+		fprintf(stderr, "usage: %s [entries] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	buffer = gst_buffer_new_and_alloc(188);
+	queue_init(&queue);
+
+	for (round = 0; round < rounds; round++)
+	{
+		int i;
+		size_t total = 0;
+		double start, pushed, drained;
+		GstBuffer *queuebuffer;
+		size_t queuestart, queueend;
+
+		start = now();
+		for (i = 0; i < entries; i++)
+		{
+			queue_push(&queue, buffer, i % 188, 188);
+		}
+		pushed = now();
+		while (queue_front(&queue, &queuebuffer, &queuestart, &queueend) >= 0)
+		{
+			total += queueend - queuestart;
+			queue_pop(&queue);
+		}
+		drained = now();
+
+		printf("round %d (%s): %d entries, push %.1f ns/op, drain %.1f ns/op, %lu bytes\n",
+			round, round ? "warm" : "cold", entries,
+			(pushed - start) * 1e9 / entries,
+			(drained - pushed) * 1e9 / entries,
+			(unsigned long)total);
+	}
+
+	queue_free(&queue);
+	gst_buffer_unref(buffer);
+	return 0;
+}
@@ -0,0 +1,533 @@
+/*
+ * End-to-end benchmark for dvbvideosink and dvbaudiosink
+ *
+ * Feeds synthetic streams into the sink pad of the elements, the way a
+ * demuxer would, and lets them write to /dev/null through the file backend,
+ * or into the emulated decoder of the mock backend. Every case runs until
+ * EOS returned, and prints one line of space separated key=value pairs:
+ * throughput, buffers per second, system calls on the device and cpu time
+ * (of the whole process, so including writer and mock threads) per buffer.
+ *
+ * Video buffers carry timestamps 1us apart, audio buffers none, so the mock
+ * backend drains them as fast as it can instead of in real time.
+ *
+ * With -z it measures zap and seek latency instead: every iteration flushes
+ * the sink (and with -s sets new caps, like a channel switch), then feeds the
+ * stream from a key frame at 25 buffers per second of stream time, polling
+ * get-decoder-time after every buffer, until the sink posts its
+ * dvbsink-latency message for the flush. Prints p50/p95/p99 of the time from
+ * the flush to the first write and to the first decoder PTS, per case.
+ *
+ * usage: bench-sinks [-m] [-d device] [-t] [-r] [-u] [-z iterations [-s]] [-c case] [buffers]
+ *   -m  write to the mock backend instead of /dev/null
+ *   -d  write to this decoder device with the dvb backend (use with -c)
+ *   -t  use the writer thread
+ *   -r  use the shared writer (reactor) thread
+ *   -u  use the io_uring backend
+ *   -z  measure zap latency over this many flushes, needs -m or -d
+ *   -s  set new caps after every flush
+ *   -c  only run this case
+ * The plugin is looked up through GST_PLUGIN_PATH, "make bench" points it
+ * at the one just built.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <gst/gst.h>
+
+typedef struct bench_case
+{
+	const char *name;
+	const char *element;
+	const char *caps;
+	/* codec_data added to the caps, NULL for none */
+	const guint8 *codec_data;
+	size_t codec_data_len;
+	size_t size;
+	/* fill in buffer index of the stream */
+	void (*fill)(guint8 *data, size_t size, int index);
+	/* send a flush (a seek) before every buffer with an index that is a multiple of this */
+	int flush_interval;
+	gboolean timestamps;
+} bench_case_t;
+
+static const guint8 avcc2[] =
+{
+	0x01, 0x64, 0x00, 0x28, 0xfd, 0xe1,
+	0x00, 0x1b, 0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78, 0x02, 0x27, 0xe5, 0xc0, 0x44, 0x00,
+	0x00, 0x03, 0x00, 0x04, 0x00, 0x00, 0x03, 0x00, 0xc8, 0x3c, 0x60, 0xc6, 0x58,
+	0x01, 0x00, 0x06, 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0
+};
+
+static const guint8 avcc4[] =
+{
+	0x01, 0x64, 0x00, 0x28, 0xff, 0xe1,
+	0x00, 0x1b, 0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78, 0x02, 0x27, 0xe5, 0xc0, 0x44, 0x00,
+	0x00, 0x03, 0x00, 0x04, 0x00, 0x00, 0x03, 0x00, 0xc8, 0x3c, 0x60, 0xc6, 0x58,
+	0x01, 0x00, 0x06, 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0
+};
+
+/* AAC LC, 44100 Hz, stereo */
+static const guint8 aac_config[] = { 0x12, 0x10 };
+
+static const guint8 wma_config[] = { 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+/* a frame of slices of about 1400 bytes each, with length fields of len_size bytes */
+static void fill_avc(guint8 *data, size_t size, int index, int len_size)
+{
+	size_t pos = 0;
+	memset(data, 0x55, size);
+	while (pos < size)
+	{
+		size_t nal_len = MIN(1400, size - pos - len_size);
+		int i;
+		for (i = 0; i < len_size; i++)
+		{
+			data[pos + i] = nal_len >> (8 * (len_size - 1 - i));
+		}
+		/* IDR slice every 25 frames, non-IDR slices otherwise */
+		data[pos + len_size] = index % 25 ? 0x41 : 0x65;
+		pos += len_size + nal_len;
+	}
+}
+
+static void fill_avc2(guint8 *data, size_t size, int index)
+{
+	fill_avc(data, size, index, 2);
+}
+
+static void fill_avc4(guint8 *data, size_t size, int index)
+{
+	fill_avc(data, size, index, 4);
+}
+
+/* the sequence header only comes with the first frame, every 12th frame
+ * starts a GOP, and the sink injects the header there after a flush */
+static void fill_mpeg2(guint8 *data, size_t size, int index)
+{
+	static const guint8 sequence_header[] = { 0x00, 0x00, 0x01, 0xb3, 0x2d, 0x02, 0x40, 0x33, 0xff, 0xff, 0xe0, 0x18 };
+	static const guint8 gop[] = { 0x00, 0x00, 0x01, 0xb8, 0x00, 0x08, 0x00, 0x40 };
+	static const guint8 picture[] = { 0x00, 0x00, 0x01, 0x00, 0x00, 0x0f, 0xff, 0xf8 };
+	size_t pos = 0;
+	memset(data, 0x55, size);
+	if (!index)
+	{
+		memcpy(data, sequence_header, sizeof(sequence_header));
+		pos += sizeof(sequence_header);
+	}
+	if (!(index % 12))
+	{
+		memcpy(data + pos, gop, sizeof(gop));
+		pos += sizeof(gop);
+	}
+	memcpy(data + pos, picture, sizeof(picture));
+}
+
+/* an unpacked DivX 5 stream, I P B B P B B ..., which the sink packs */
+static void fill_divx5(guint8 *data, size_t size, int index)
+{
+	/* video_object_layer with a vop_time_increment_resolution of 25 */
+	static const guint8 vol[] = { 0x00, 0x00, 0x01, 0x20, 0x00, 0x84, 0x40, 0x06, 0x60 };
+	int type = !(index % 12) ? 0 : index % 3 == 1 ? 1 : 2;
+	size_t pos = 0;
+	memset(data, 0x55, size);
+	if (!index)
+	{
+		memcpy(data, vol, sizeof(vol));
+		pos += sizeof(vol);
+	}
+	data[pos++] = 0x00;
+	data[pos++] = 0x00;
+	data[pos++] = 0x01;
+	data[pos++] = 0xb6;
+	/* vop_coding_type, modulo_time_base 0, marker, vop_time_increment 0 */
+	data[pos++] = (type << 6) | 0x10;
+	data[pos] = 0x00;
+}
+
+static void fill_audio(guint8 *data, size_t size, int index)
+{
+	memset(data, index, size);
+}
+
+static const bench_case_t cases[] =
+{
+	{ "h264-avc2", "dvbvideosink", "video/x-h264, width=(int)1920, height=(int)1080, framerate=(fraction)25/1",
+		avcc2, sizeof(avcc2), 16384, fill_avc2, 0, TRUE },
+	{ "h264-avc4", "dvbvideosink", "video/x-h264, width=(int)1920, height=(int)1080, framerate=(fraction)25/1",
+		avcc4, sizeof(avcc4), 16384, fill_avc4, 0, TRUE },
+	{ "mpeg2", "dvbvideosink", "video/mpeg, mpegversion=(int)2, systemstream=(boolean)false, width=(int)720, height=(int)576, framerate=(fraction)25/1",
+		NULL, 0, 16384, fill_mpeg2, 12, TRUE },
+	{ "divx5", "dvbvideosink", "video/x-divx, divxversion=(int)5, width=(int)720, height=(int)576, framerate=(fraction)25/1",
+		NULL, 0, 16384, fill_divx5, 0, TRUE },
+	{ "aac-raw", "dvbaudiosink", "audio/mpeg, mpegversion=(int)4, stream-format=(string)raw, framed=(boolean)true, rate=(int)44100, channels=(int)2",
+		aac_config, sizeof(aac_config), 768, fill_audio, 0, FALSE },
+	{ "wma", "dvbaudiosink", "audio/x-wma, wmaversion=(int)2, framed=(boolean)true, bitrate=(int)128000, depth=(int)16, rate=(int)44100, channels=(int)2, block_align=(int)2973",
+		wma_config, sizeof(wma_config), 2973, fill_audio, 0, FALSE },
+	{ "pcm16", "dvbaudiosink", "audio/x-raw-int, endianness=(int)" G_STRINGIFY(G_BYTE_ORDER) ", signed=(boolean)true, width=(int)16, depth=(int)16, rate=(int)48000, channels=(int)2",
+		NULL, 0, 8192, fill_audio, 0, FALSE },
+	{ "pcm24", "dvbaudiosink", "audio/x-raw-int, endianness=(int)" G_STRINGIFY(G_BYTE_ORDER) ", signed=(boolean)true, width=(int)24, depth=(int)24, rate=(int)48000, channels=(int)2",
+		NULL, 0, 8192, fill_audio, 0, FALSE },
+	{ "pcm32", "dvbaudiosink", "audio/x-raw-int, endianness=(int)" G_STRINGIFY(G_BYTE_ORDER) ", signed=(boolean)true, width=(int)32, depth=(int)32, rate=(int)48000, channels=(int)2",
+		NULL, 0, 8192, fill_audio, 0, FALSE },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cputime(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void send_newsegment(GstPad *pad)
+{
+	gst_pad_send_event(pad, gst_event_new_new_segment(FALSE, 1.0, GST_FORMAT_TIME, 0, -1, 0));
+}
+
+static GstCaps *make_caps(const bench_case_t *c)
+{
+	GstCaps *caps = gst_caps_from_string(c->caps);
+	if (c->codec_data)
+	{
+		GstBuffer *codec_data = gst_buffer_new_and_alloc(c->codec_data_len);
+		memcpy(GST_BUFFER_DATA(codec_data), c->codec_data, c->codec_data_len);
+		gst_caps_set_simple(caps, "codec_data", GST_TYPE_BUFFER, codec_data, NULL);
+		gst_buffer_unref(codec_data);
+	}
+	return caps;
+}
+
+/* the mock backend, the dvb backend on device, or /dev/null through the file backend */
+static GstElement *make_sink(const bench_case_t *c, gboolean mock, const char *device)
+{
+	GstElement *sink = gst_element_factory_make(c->element, NULL);
+	if (!sink)
+	{
+		fprintf(stderr, "%s: no %s element, is GST_PLUGIN_PATH set?\n", c->name, c->element);
+		return NULL;
+	}
+	g_object_set(sink, "sync", FALSE, "async", FALSE, NULL);
+	if (mock)
+	{
+		gst_util_set_object_arg(G_OBJECT(sink), "backend", "mock");
+	}
+	else if (device)
+	{
+		gst_util_set_object_arg(G_OBJECT(sink), "backend", "dvb");
+		g_object_set(sink, "device", device, NULL);
+	}
+	else
+	{
+		gst_util_set_object_arg(G_OBJECT(sink), "backend", "file");
+		g_object_set(sink, "device", "/dev/null", NULL);
+	}
+	return sink;
+}
+
+static int run_case(const bench_case_t *c, int buffers, gboolean mock, const char *device, gboolean threaded, gboolean shared, gboolean uring)
+{
+	GstElement *sink;
+	GstPad *pad;
+	GstCaps *caps;
+	guint64 bytes = 0, written = 0, syscalls = 0;
+	double start, end, cpustart, cpuend;
+	int i;
+
+	sink = make_sink(c, mock, device);
+	if (!sink) return -1;
+	g_object_set(sink, "writer-thread", threaded, "shared-writer", shared, "io-uring", uring, NULL);
+	pad = gst_element_get_static_pad(sink, "sink");
+
+	if (gst_element_set_state(sink, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+	{
+		fprintf(stderr, "%s: can't start %s\n", c->name, c->element);
+		goto error;
+	}
+
+	caps = make_caps(c);
+	if (!gst_pad_set_caps(pad, caps))
+	{
+		printf("case=%s element=%s error=caps\n", c->name, c->element);
+		gst_caps_unref(caps);
+		goto error;
+	}
+	send_newsegment(pad);
+
+	start = now();
+	cpustart = cputime();
+	for (i = 0; i < buffers; i++)
+	{
+		GstBuffer *buffer;
+		GstFlowReturn ret;
+
+		if (i && c->flush_interval && !(i % c->flush_interval))
+		{
+			gst_pad_send_event(pad, gst_event_new_flush_start());
+			gst_pad_send_event(pad, gst_event_new_flush_stop());
+			send_newsegment(pad);
+		}
+
+		/* a new buffer every time, like from a demuxer, the sink may convert it in place */
+		buffer = gst_buffer_new_and_alloc(c->size);
+		c->fill(GST_BUFFER_DATA(buffer), c->size, i);
+		gst_buffer_set_caps(buffer, caps);
+		if (c->timestamps)
+		{
+			GST_BUFFER_TIMESTAMP(buffer) = i * GST_USECOND;
+		}
+		bytes += c->size;
+		ret = gst_pad_chain(pad, buffer);
+		if (ret != GST_FLOW_OK)
+		{
+			fprintf(stderr, "%s: flow %s at buffer %d\n", c->name, gst_flow_get_name(ret), i);
+			break;
+		}
+	}
+	gst_pad_send_event(pad, gst_event_new_eos());
+	end = now();
+	cpuend = cputime();
+	gst_caps_unref(caps);
+
+	g_object_get(sink, "bytes-written", &written, "syscalls", &syscalls, NULL);
+	printf("case=%s element=%s backend=%s mode=%s buffers=%d bytes_in=%llu bytes_out=%llu "
+		"seconds=%.3f mb_per_s=%.1f buffers_per_s=%.0f syscalls_per_buffer=%.2f cpu_us_per_buffer=%.2f\n",
+		c->name, c->element, mock ? "mock" : device ? "dvb" : "null",
+		uring ? "io_uring" : shared ? "shared-writer" : threaded ? "writer-thread" : "poll",
+		i, (unsigned long long)bytes, (unsigned long long)written,
+		end - start, bytes / (end - start) / 1e6, i / (end - start),
+		i ? (double)syscalls / i : 0.0, i ? (cpuend - cpustart) * 1e6 / i : 0.0);
+
+	gst_element_set_state(sink, GST_STATE_NULL);
+	gst_object_unref(pad);
+	gst_object_unref(sink);
+	return 0;
+
+error:
+	gst_element_set_state(sink, GST_STATE_NULL);
+	gst_object_unref(pad);
+	gst_object_unref(sink);
+	return -1;
+}
+
+/* buffers fed after a flush before only polling for the first PTS, and how long to wait for it */
+#define ZAP_BUFFERS 50
+#define ZAP_TIMEOUT 2.0
+
+static int compare_times(const void *a, const void *b)
+{
+	guint64 x = *(const guint64*)a, y = *(const guint64*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile of the sorted times, in ms */
+static double percentile(const guint64 *times, int count, int p)
+{
+	int rank = (count * p + 99) / 100;
+	if (!count) return 0.0;
+	return times[MAX(rank, 1) - 1] / 1e6;
+}
+
+/* returns TRUE and the latency from the message when the sink posted it for a flush */
+static gboolean pop_latency(GstBus *bus, guint64 *first_write, guint64 *first_pts)
+{
+	GstMessage *message;
+	gboolean found = FALSE;
+	while ((message = gst_bus_pop(bus)))
+	{
+		const GstStructure *s = gst_message_get_structure(message);
+		gboolean flushed = FALSE;
+		if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ELEMENT && gst_structure_has_name(s, "dvbsink-latency")
+			&& gst_structure_get_boolean(s, "flushed", &flushed) && flushed)
+		{
+			gst_structure_get_uint64(s, "first-write", first_write);
+			gst_structure_get_uint64(s, "first-pts", first_pts);
+			found = TRUE;
+		}
+		gst_message_unref(message);
+	}
+	return found;
+}
+
+static int run_zap_case(const bench_case_t *c, int iterations, gboolean mock, const char *device, gboolean switch_caps)
+{
+	GstElement *sink;
+	GstPad *pad;
+	GstBus *bus;
+	GstCaps *caps;
+	guint64 *writes, *pts;
+	guint64 position = 0;
+	int i, measured = 0, missed = 0;
+
+	sink = make_sink(c, mock, device);
+	if (!sink) return -1;
+	bus = gst_bus_new();
+	gst_element_set_bus(sink, bus);
+	pad = gst_element_get_static_pad(sink, "sink");
+	writes = g_new(guint64, iterations);
+	pts = g_new(guint64, iterations);
+
+	if (gst_element_set_state(sink, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+	{
+		fprintf(stderr, "%s: can't start %s\n", c->name, c->element);
+		goto error;
+	}
+	caps = make_caps(c);
+	if (!gst_pad_set_caps(pad, caps))
+	{
+		printf("case=%s element=%s error=caps\n", c->name, c->element);
+		gst_caps_unref(caps);
+		goto error;
+	}
+
+	for (i = 0; i < iterations; i++)
+	{
+		guint64 first_write = 0, first_pts = 0;
+		gboolean found = FALSE;
+		double deadline;
+		int n;
+
+		gst_pad_send_event(pad, gst_event_new_flush_start());
+		gst_pad_send_event(pad, gst_event_new_flush_stop());
+		if (switch_caps)
+		{
+			/* caps that differ from the last ones, so the sink sets up the decoder again */
+			GstCaps *switched = gst_caps_copy(caps);
+			gst_caps_set_simple(switched, "zap", G_TYPE_INT, i, NULL);
+			gst_pad_set_caps(pad, switched);
+			gst_caps_unref(switched);
+		}
+		send_newsegment(pad);
+
+		deadline = now() + ZAP_TIMEOUT;
+		for (n = 0; !found && now() < deadline; n++)
+		{
+			gint64 decoder_time;
+			if (n < ZAP_BUFFERS)
+			{
+				/* from a key frame (index 0) on, the stream position goes on across flushes like in a seek */
+				GstBuffer *buffer = gst_buffer_new_and_alloc(c->size);
+				c->fill(GST_BUFFER_DATA(buffer), c->size, n);
+				gst_buffer_set_caps(buffer, caps);
+				GST_BUFFER_TIMESTAMP(buffer) = GST_SECOND + position++ * 40 * GST_MSECOND;
+				if (gst_pad_chain(pad, buffer) != GST_FLOW_OK) break;
+			}
+			else
+			{
+				g_usleep(1000);
+			}
+			g_signal_emit_by_name(sink, "get-decoder-time", &decoder_time);
+			found = pop_latency(bus, &first_write, &first_pts);
+		}
+		if (found)
+		{
+			writes[measured] = first_write;
+			pts[measured] = first_pts;
+			measured++;
+		}
+		else
+		{
+			missed++;
+		}
+	}
+	gst_caps_unref(caps);
+
+	qsort(writes, measured, sizeof(*writes), compare_times);
+	qsort(pts, measured, sizeof(*pts), compare_times);
+	printf("case=%s element=%s backend=%s mode=%s iterations=%d missed=%d "
+		"write_p50_ms=%.2f write_p95_ms=%.2f write_p99_ms=%.2f pts_p50_ms=%.2f pts_p95_ms=%.2f pts_p99_ms=%.2f\n",
+		c->name, c->element, mock ? "mock" : "dvb", switch_caps ? "caps" : "seek", iterations, missed,
+		percentile(writes, measured, 50), percentile(writes, measured, 95), percentile(writes, measured, 99),
+		percentile(pts, measured, 50), percentile(pts, measured, 95), percentile(pts, measured, 99));
+
+	gst_element_set_state(sink, GST_STATE_NULL);
+	gst_object_unref(pad);
+	gst_object_unref(bus);
+	gst_object_unref(sink);
+	g_free(writes);
+	g_free(pts);
+	return missed == iterations ? -1 : 0;
+
+error:
+	gst_element_set_state(sink, GST_STATE_NULL);
+	gst_object_unref(pad);
+	gst_object_unref(bus);
+	gst_object_unref(sink);
+	g_free(writes);
+	g_free(pts);
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int buffers = 20000, zap = 0;
+	const char *only = NULL, *device = NULL;
+	gboolean mock = FALSE, threaded = FALSE, shared = FALSE, uring = FALSE, switch_caps = FALSE;
+	int opt, failed = 0;
+	unsigned i;
+
+	gst_init(&argc, &argv);
+
+	while ((opt = getopt(argc, argv, "md:truz:sc:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			mock = TRUE;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			threaded = TRUE;
+			break;
+		case 'r':
+			shared = TRUE;
+			break;
+		case 'u':
+			uring = TRUE;
+			break;
+		case 'z':
+			zap = atoi(optarg);
+			break;
+		case 's':
+			switch_caps = TRUE;
+			break;
+		case 'c':
+			only = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind < argc) buffers = atoi(argv[optind]);
+	/* /dev/null never reports a PTS */
+	if (zap && !mock && !device) goto usage;
+
+	for (i = 0; i < G_N_ELEMENTS(cases); i++)
+	{
+		int ret;
+		if (only && strcmp(only, cases[i].name)) continue;
+		ret = zap ? run_zap_case(&cases[i], zap, mock, device, switch_caps) : run_case(&cases[i], buffers, mock, device, threaded, shared, uring);
+		if (ret < 0) failed++;
+	}
+	return failed ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-m] [-d device] [-t] [-r] [-u] [-z iterations [-s]] [-c case] [buffers]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,182 @@
+/*
+ * Benchmark for the write engine in common.c
+ *
+ * Writes PES-like buffers (a small header plus a payload buffer) through the
+ * write engine, into a stand-in for the decoder device: a FIFO drained by a
+ * child process (the default), or a regular file. Reports throughput, time
+ * and cpu time per buffer for the selected backend.
+ *
+ * usage: bench-write [-u] [-t] [-r] [-s] [-o file] [buffers] [size]
+ *   -u  use the io_uring backend
+ *   -t  use the writer thread
+ *   -r  use the shared writer (reactor) thread
+ *   -s  move the data with vmsplice and splice (needs -o, a FIFO would
+ *       keep referencing the pages, so the engine falls back to write)
+ *   -o  write to this regular file instead of a FIFO
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <gst/gst.h>
+
+#include "common.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cputime(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static pid_t start_reader(const char *path)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		char buf[65536];
+		int fd = open(path, O_RDONLY);
+		while (fd >= 0 && read(fd, buf, sizeof(buf)) > 0);
+		_exit(0);
+	}
+	return pid;
+}
+
+int main(int argc, char *argv[])
+{
+	int buffers = 20000;
+	int size = 16384;
+	const char *output = NULL;
+	char fifo[64];
+	gboolean uring = FALSE, threaded = FALSE, shared = FALSE, use_splice = FALSE;
+	pid_t reader = -1;
+	GstElement *element;
+	GstBuffer *payload;
+	write_engine_t engine;
+	unsigned char header[14];
+	double start, end, cpustart, cpuend;
+	int opt, i;
+
+	gst_init(&argc, &argv);
+
+	while ((opt = getopt(argc, argv, "utrso:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'u':
+			uring = TRUE;
+			break;
+		case 't':
+			threaded = TRUE;
+			break;
+		case 'r':
+			shared = TRUE;
+			break;
+		case 's':
+			use_splice = TRUE;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-u] [-t] [-r] [-s] [-o file] [buffers] [size]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) buffers = atoi(argv[optind++]);
+	if (optind < argc) size = atoi(argv[optind++]);
+	if (buffers <= 0 || size <= 0)
+	{
+		fprintf(stderr, "usage: %s [-u] [-t] [-r] [-s] [-o file] [buffers] [size]\n", argv[0]);
+		return 1;
+	}
+
+	element = gst_pipeline_new("bench");
+	write_engine_init(&engine, element, NULL);
+	engine.use_uring = uring;
+	engine.threaded = threaded;
+	engine.shared_writer = shared;
+	engine.use_splice = use_splice;
+	engine.ring_depth = 256;
+	if (write_engine_start(&engine) < 0) return 1;
+
+	if (output)
+	{
+		engine.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	else
+	{
+		snprintf(fifo, sizeof(fifo), "/tmp/bench-write-%d", (int)getpid());
+		if (mkfifo(fifo, 0600) < 0)
+		{
+			perror(fifo);
+			return 1;
+		}
+		reader = start_reader(fifo);
+		engine.fd = open(fifo, O_WRONLY);
+		unlink(fifo);
+	}
+	if (engine.fd < 0)
+	{
+		perror("open");
+		return 1;
+	}
+	fcntl(engine.fd, F_SETFL, O_NONBLOCK);
+
+	payload = gst_buffer_new_and_alloc(size);
+	memset(GST_BUFFER_DATA(payload), 0x55, size);
+	memset(header, 0, sizeof(header));
+	header[2] = 0x01;
+	header[3] = 0xe0;
+
+	start = now();
+	cpustart = cputime();
+	for (i = 0; i < buffers; i++)
+	{
+		write_segment_t segments[2];
+		pes_set_payload_size(size + sizeof(header) - 6, header);
+		segments[0] = (write_segment_t) { NULL, header, sizeof(header) };
+		segments[1] = (write_segment_t) { payload, GST_BUFFER_DATA(payload), size };
+		if (write_engine_write(&engine, segments, 2) < 0)
+		{
+			perror("write");
+			break;
+		}
+	}
+	write_engine_drain(&engine);
+	end = now();
+	cpuend = cputime();
+
+	printf("%s%s%s, %s: %d buffers of %d bytes, %.1f MB/s, %.2f us/buffer, %.2f us cpu/buffer, %.2f syscalls/buffer, %llu bytes written, %llu spliced\n",
+		engine.uring ? "io_uring" : "poll", engine.reactor ? " + shared writer" : engine.ring.entries ? " + writer thread" : "",
+		engine.splicepipe[0] >= 0 ? " + splice" : "",
+		output ? "file" : "fifo", i, size,
+		(double)i * (size + sizeof(header)) / (end - start) / 1e6,
+		(end - start) * 1e6 / i, (cpuend - cpustart) * 1e6 / i, (double)engine.syscalls / i,
+		(unsigned long long)engine.bytes_written, (unsigned long long)engine.bytes_spliced);
+
+	write_engine_stop(&engine);
+	close(engine.fd);
+	if (reader > 0) waitpid(reader, NULL, 0);
+	gst_buffer_unref(payload);
+	gst_object_unref(element);
+	return 0;
+}
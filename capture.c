@@ -0,0 +1,133 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <linux/dvb/video.h>
+
+#include <gst/gst.h>
+
+#include "common.h"
+#include "device.h"
+#include "capture.h"
+
+struct capture
+{
+	FILE *data;
+	FILE *index;
+	/* bytes written to data so far */
+	guint64 offset;
+	/* CLOCK_MONOTONIC at the start, in ns */
+	guint64 start;
+	/* writes come from the streaming thread, ioctls from any thread */
+	GMutex *mutex;
+};
+
+static guint64 capture_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+/* returns NULL with errno set when path or its index can't be created */
+struct capture *capture_open(const char *path)
+{
+	struct capture *capture = g_new0(struct capture, 1);
+	gchar *index_path = g_strconcat(path, CAPTURE_INDEX_SUFFIX, NULL);
+	struct timeval tv;
+
+	capture->data = fopen(path, "wb");
+	capture->index = fopen(index_path, "w");
+	g_free(index_path);
+	if (!capture->data || !capture->index)
+	{
+		int err = errno;
+		if (capture->data) fclose(capture->data);
+		if (capture->index) fclose(capture->index);
+		g_free(capture);
+		errno = err;
+		return NULL;
+	}
+	capture->mutex = g_mutex_new();
+	capture->start = capture_now();
+	gettimeofday(&tv, NULL);
+	fprintf(capture->index, "# dvbmediasink capture 1\n# start %ld.%06ld\n", (long)tv.tv_sec, (long)tv.tv_usec);
+	fflush(capture->index);
+	return capture;
+}
+
+void capture_close(struct capture *capture)
+{
+	if (!capture) return;
+	fclose(capture->data);
+	fclose(capture->index);
+	g_mutex_free(capture->mutex);
+	g_free(capture);
+}
+
+/* the PTS of the PES header the data starts with, in 90kHz units, or -1 */
+static gint64 capture_pes_pts(const write_segment_t *segments, int count)
+{
+	guint8 header[14];
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < count && len < sizeof(header); i++)
+	{
+		size_t n = MIN(segments[i].len, sizeof(header) - len);
+		memcpy(header + len, segments[i].data, n);
+		len += n;
+	}
+	if (len < sizeof(header) || memcmp(header, "\x00\x00\x01", 3) || !(header[7] & 0x80)) return -1;
+	return ((gint64)(header[9] & 0x0e) << 29) | (header[10] << 22) | ((header[11] & 0xfe) << 14) | (header[12] << 7) | (header[13] >> 1);
+}
+
+void capture_write(struct capture *capture, const write_segment_t *segments, int count)
+{
+	size_t size = segments_size(segments, count);
+	gint64 pts = capture_pes_pts(segments, count);
+	int i;
+
+	g_mutex_lock(capture->mutex);
+	fprintf(capture->index, "%" G_GUINT64_FORMAT " write %" G_GUINT64_FORMAT " %u ", capture_now() - capture->start, capture->offset, (unsigned int)size);
+	if (pts >= 0) fprintf(capture->index, "%" G_GINT64_FORMAT "\n", pts);
+	else fputs("-\n", capture->index);
+	for (i = 0; i < count; i++)
+	{
+		fwrite(segments[i].data, 1, segments[i].len, capture->data);
+	}
+	capture->offset += size;
+	/* flush every record, the point is to have it when the box hangs */
+	fflush(capture->data);
+	fflush(capture->index);
+	g_mutex_unlock(capture->mutex);
+}
+
+void capture_ioctl(struct capture *capture, unsigned long request, unsigned long arg)
+{
+	guint64 now = capture_now();
+
+	g_mutex_lock(capture->mutex);
+	if (request == VIDEO_SET_CODEC_DATA)
+	{
+		const video_codec_data_t *codec_data = (const video_codec_data_t*)(gsize)arg;
+		int i;
+		fprintf(capture->index, "%" G_GUINT64_FORMAT " ioctl %#lx %d ", now - capture->start, request, codec_data->length);
+		for (i = 0; i < codec_data->length; i++)
+		{
+			fprintf(capture->index, "%02x", codec_data->data[i]);
+		}
+		fputc('\n', capture->index);
+	}
+	else if (_IOC_DIR(request) == _IOC_NONE)
+	{
+		fprintf(capture->index, "%" G_GUINT64_FORMAT " ioctl %#lx %lu\n", now - capture->start, request, arg);
+	}
+	fflush(capture->index);
+	g_mutex_unlock(capture->mutex);
+}
@@ -0,0 +1,27 @@
+#ifndef _capture_h
+#define _capture_h
+
+/* a capture records what a sink feeds its decoder: the data written to the
+ * device goes to a file, and every write and control ioctl gets a line in a
+ * side index (the file name with .idx appended), so dvbreplay can feed the
+ * same stream to a device again.
+ *
+ * The index starts with comment lines (#), the start time of the capture in
+ * seconds since the epoch is in "# start <seconds>". Every other line starts
+ * with the nanoseconds since the start:
+ *   <ns> write <offset> <size> <pts>   pts in 90kHz units, - if there is none
+ *   <ns> ioctl <request> <arg>         ioctls passing a number (or nothing)
+ *   <ns> ioctl <request> <arg> <hex>   VIDEO_SET_CODEC_DATA, arg is the length
+ * The request is in hex, ioctls reading from the device are not recorded */
+
+struct capture;
+struct write_segment;
+
+#define CAPTURE_INDEX_SUFFIX ".idx"
+
+struct capture *capture_open(const char *path);
+void capture_close(struct capture *capture);
+void capture_write(struct capture *capture, const struct write_segment *segments, int count);
+void capture_ioctl(struct capture *capture, unsigned long request, unsigned long arg);
+
+#endif
@@ -1,38 +1,146 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* vmsplice, splice */
+#endif
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include <gst/gst.h>
 
 #include "common.h"
+#include "capture.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
+GST_DEBUG_CATEGORY_STATIC(dvbsink_write_debug);
+#define GST_CAT_DEFAULT dvbsink_write_debug
 
-void queue_push(queue_entry_t **queue_base, GstBuffer *buffer, size_t start, size_t end)
+/* writes smaller than this are not worth the vmsplice */
+#define SPLICE_MIN_BYTES (16 * 1024)
+#define SPLICE_PIPE_SIZE (256 * 1024)
+
+void queue_init(queue_t *queue)
 {
-	queue_entry_t *entry = g_malloc(sizeof(queue_entry_t));
-	queue_entry_t *last = *queue_base;
+	queue->head = queue->tail = NULL;
+	queue->pool = NULL;
+	queue->bytes = 0;
+	queue->high_watermark = queue->low_watermark = 0;
+	queue->full = FALSE;
+}
+
+void queue_clear(queue_t *queue)
+{
+	while (queue->head)
+	{
+		queue_pop(queue);
+	}
+}
+
+void queue_free(queue_t *queue)
+{
+	queue_clear(queue);
+	while (queue->pool)
+	{
+		queue_entry_t *entry = queue->pool;
+		queue->pool = entry->next;
+		g_free(entry);
+	}
+}
+
+void queue_push(queue_t *queue, GstBuffer *buffer, size_t start, size_t end)
+{
+	queue_entry_t *entry = queue->pool;
+	if (entry)
+	{
+		queue->pool = entry->next;
+	}
+	else
+	{
+		entry = g_malloc(sizeof(queue_entry_t));
+	}
 	gst_buffer_ref(buffer);
 	entry->buffer = buffer;
 	entry->start = start;
 	entry->end = end;
-	if (!last)
+	entry->next = NULL;
+	if (queue->tail)
 	{
-		*queue_base = entry;
+		queue->tail->next = entry;
 	}
 	else
 	{
-		while (last->next) last = last->next;
-		last->next = entry;
+		g_atomic_pointer_set((gpointer*)&queue->head, entry);
+	}
+	queue->tail = entry;
+	queue->bytes += end - start;
+	if (queue->high_watermark && queue->bytes >= queue->high_watermark)
+	{
+		queue->full = TRUE;
 	}
-	entry->next = NULL;
 }
 
-void queue_pop(queue_entry_t **queue_base)
+static void queue_update_full(queue_t *queue)
 {
-	queue_entry_t *base = *queue_base;
-	*queue_base = base->next;
+	if (queue->full && queue->bytes <= queue->low_watermark)
+	{
+		queue->full = FALSE;
+	}
+}
+
+void queue_pop(queue_t *queue)
+{
+	queue_entry_t *base = queue->head;
+	g_atomic_pointer_set((gpointer*)&queue->head, base->next);
+	if (!queue->head) queue->tail = NULL;
+	queue->bytes -= base->end - base->start;
 	gst_buffer_unref(base->buffer);
-	g_free(base);
+	base->buffer = NULL;
+	base->next = queue->pool;
+	queue->pool = base;
+	queue_update_full(queue);
+}
+
+void queue_advance(queue_t *queue, size_t len)
+{
+	queue->head->start += len;
+	queue->bytes -= len;
+	queue_update_full(queue);
+}
+
+void queue_set_watermarks(queue_t *queue, size_t high, size_t low)
+{
+	queue->high_watermark = high;
+	queue->low_watermark = MIN(low, high);
+	queue->full = high && queue->bytes >= high;
+}
+
+gboolean queue_is_full(queue_t *queue)
+{
+	return queue->full;
+}
+
+/* can be called without holding the lock that protects the queue,
+ * the answer may be outdated by the time it is used */
+gboolean queue_is_empty(queue_t *queue)
+{
+	return g_atomic_pointer_get((gpointer*)&queue->head) == NULL;
 }
 
-int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, size_t *end)
+int queue_front(queue_t *queue, GstBuffer **buffer, size_t *start, size_t *end)
 {
-	if (!*queue_base)
+	if (!queue->head)
 	{
 		*buffer = NULL;
 		*start = 0;
@@ -41,7 +149,7 @@ int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, s
 	}
 	else
 	{
-		queue_entry_t *entry = *queue_base;
+		queue_entry_t *entry = queue->head;
 		*buffer = entry->buffer;
 		*start = entry->start;
 		*end = entry->end;
@@ -49,6 +157,1456 @@ int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, s
 	}
 }
 
+void queue_push_segments(queue_t *queue, const write_segment_t *segments, int count)
+{
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		GstBuffer *buffer = segments[i].buffer;
+		size_t len = segments[i].len;
+		if (!len) continue;
+		if (buffer)
+		{
+			size_t start = segments[i].data - GST_BUFFER_DATA(buffer);
+			queue_push(queue, buffer, start, start + len);
+		}
+		else
+		{
+			/* the data won't be valid anymore when we get to write it, keep a copy */
+			buffer = gst_buffer_new_and_alloc(len);
+			memcpy(GST_BUFFER_DATA(buffer), segments[i].data, len);
+			queue_push(queue, buffer, 0, len);
+			gst_buffer_unref(buffer);
+		}
+	}
+}
+
+/* describe up to max queued entries in iov, returns the number of iovecs used */
+int queue_fill_iov(queue_t *queue, struct iovec *iov, int max)
+{
+	int count = 0;
+	queue_entry_t *entry;
+
+	for (entry = queue->head; entry && count < max; entry = entry->next)
+	{
+		iov[count].iov_base = GST_BUFFER_DATA(entry->buffer) + entry->start;
+		iov[count].iov_len = entry->end - entry->start;
+		count++;
+	}
+	return count;
+}
+
+/* write as many queued entries as possible with a single writev,
+ * and remove what has been written from the queue */
+ssize_t queue_write(queue_t *queue, int fd)
+{
+	struct iovec iov[WRITE_MAX_IOV];
+	int count = queue_fill_iov(queue, iov, WRITE_MAX_IOV);
+	ssize_t wr;
+
+	if (!count) return 0;
+
+	wr = writev(fd, iov, count);
+	if (wr > 0) queue_consume(queue, wr);
+	return wr;
+}
+
+/* remove len written bytes from the front of the queue */
+void queue_consume(queue_t *queue, size_t len)
+{
+	size_t left = len;
+	while (left && queue->head)
+	{
+		size_t len = queue->head->end - queue->head->start;
+		if (left >= len)
+		{
+			queue_pop(queue);
+			left -= len;
+		}
+		else
+		{
+			queue_advance(queue, left);
+			left = 0;
+		}
+	}
+}
+
+size_t segments_size(const write_segment_t *segments, int count)
+{
+	size_t size = 0;
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		size += segments[i].len;
+	}
+	return size;
+}
+
+/* describe up to max segments in iov, returns the number of iovecs used */
+int segments_fill_iov(const write_segment_t *segments, int count, struct iovec *iov, int max)
+{
+	int i;
+
+	if (count > max) count = max;
+	for (i = 0; i < count; i++)
+	{
+		iov[i].iov_base = (void*)segments[i].data;
+		iov[i].iov_len = segments[i].len;
+	}
+	return count;
+}
+
+/* write the segments, WRITE_MAX_IOV per writev until one is short,
+ * returns the number of bytes written, or -1 when nothing could be written */
+ssize_t segments_write(int fd, const write_segment_t *segments, int count)
+{
+	struct iovec iov[WRITE_MAX_IOV];
+	ssize_t written = 0;
+
+	while (count > 0)
+	{
+		int n = segments_fill_iov(segments, count, iov, WRITE_MAX_IOV);
+		size_t size = segments_size(segments, n);
+		ssize_t wr = writev(fd, iov, n);
+		if (wr < 0) return written ? written : -1;
+		written += wr;
+		if ((size_t)wr < size) break;
+		segments += n;
+		count -= n;
+	}
+	return written;
+}
+
+/* skip len bytes of the segments, after a (partial) write */
+void segments_consume(write_segment_t **segments, int *count, size_t len)
+{
+	while (*count)
+	{
+		write_segment_t *segment = *segments;
+		if (len < segment->len)
+		{
+			segment->data += len;
+			segment->len -= len;
+			break;
+		}
+		len -= segment->len;
+		(*segments)++;
+		(*count)--;
+	}
+}
+
+void ring_init(ring_t *ring, guint depth)
+{
+	guint size = 2;
+	while (size < depth) size <<= 1;
+	ring->entries = g_new0(queue_entry_t, size);
+	ring->mask = size - 1;
+	ring->head = ring->tail = 0;
+}
+
+void ring_free(ring_t *ring)
+{
+	if (!ring->entries) return;
+	ring_clear(ring);
+	g_free(ring->entries);
+	ring->entries = NULL;
+}
+
+gboolean ring_is_empty(ring_t *ring)
+{
+	return g_atomic_int_get(&ring->head) == g_atomic_int_get(&ring->tail);
+}
+
+gboolean ring_is_full(ring_t *ring)
+{
+	return (guint)(g_atomic_int_get(&ring->tail) - g_atomic_int_get(&ring->head)) > ring->mask;
+}
+
+/* producer side, takes a reference on buffer, returns FALSE when the ring is full */
+gboolean ring_push(ring_t *ring, GstBuffer *buffer, size_t start, size_t end)
+{
+	guint tail = g_atomic_int_get(&ring->tail);
+	queue_entry_t *entry;
+	if (tail - (guint)g_atomic_int_get(&ring->head) > ring->mask) return FALSE;
+	entry = &ring->entries[tail & ring->mask];
+	entry->buffer = gst_buffer_ref(buffer);
+	entry->start = start;
+	entry->end = end;
+	g_atomic_int_set(&ring->tail, tail + 1);
+	return TRUE;
+}
+
+/* consumer side, drop everything in the ring */
+void ring_clear(ring_t *ring)
+{
+	guint head = g_atomic_int_get(&ring->head);
+	guint tail = g_atomic_int_get(&ring->tail);
+	for (; head != tail; head++)
+	{
+		queue_entry_t *entry = &ring->entries[head & ring->mask];
+		gst_buffer_unref(entry->buffer);
+		entry->buffer = NULL;
+	}
+	g_atomic_int_set(&ring->head, head);
+}
+
+/* consumer side, write as many entries as possible with a single writev,
+ * and remove what has been written from the ring */
+ssize_t ring_write(ring_t *ring, int fd)
+{
+	struct iovec iov[WRITE_MAX_IOV];
+	guint head = g_atomic_int_get(&ring->head);
+	guint tail = g_atomic_int_get(&ring->tail);
+	int count = 0;
+	ssize_t wr;
+	size_t left;
+
+	for (; head + count != tail && count < WRITE_MAX_IOV; count++)
+	{
+		queue_entry_t *entry = &ring->entries[(head + count) & ring->mask];
+		iov[count].iov_base = GST_BUFFER_DATA(entry->buffer) + entry->start;
+		iov[count].iov_len = entry->end - entry->start;
+	}
+	if (!count) return 0;
+
+	wr = writev(fd, iov, count);
+	if (wr <= 0) return wr;
+
+	left = wr;
+	while (left)
+	{
+		queue_entry_t *entry = &ring->entries[head & ring->mask];
+		size_t len = entry->end - entry->start;
+		if (left < len)
+		{
+			entry->start += left;
+			break;
+		}
+		gst_buffer_unref(entry->buffer);
+		entry->buffer = NULL;
+		left -= len;
+		head++;
+	}
+	g_atomic_int_set(&ring->head, head);
+	return wr;
+}
+
+void write_engine_init(write_engine_t *engine, GstElement *element, void (*event_hook)(GstElement *element))
+{
+	if (!dvbsink_write_debug)
+	{
+		GST_DEBUG_CATEGORY_INIT(dvbsink_write_debug, "dvbsinkwrite", 0, "dvb sink write engine");
+	}
+	engine->element = element;
+	engine->fd = -1;
+	engine->wakeupfd = -1;
+	queue_init(&engine->queue);
+	engine->paused = engine->flushing = engine->unlocking = 0;
+	engine->event_hook = event_hook;
+	engine->threaded = FALSE;
+	engine->ring_depth = 0;
+	engine->ring.entries = NULL;
+	engine->thread = NULL;
+	engine->shared_writer = FALSE;
+	engine->reactor = NULL;
+	engine->reactor_events = -1;
+	engine->eos_waiting = engine->decoder_empty = 0;
+	engine->mutex = NULL;
+	engine->use_uring = FALSE;
+	engine->uring = NULL;
+	engine->uring_unlock_armed = FALSE;
+	engine->cond = NULL;
+	engine->use_splice = FALSE;
+	engine->splicepipe[0] = engine->splicepipe[1] = -1;
+	engine->splice_pending = 0;
+	engine->splice_checked = FALSE;
+	engine->splice_nbuffers = 0;
+	engine->bytes_written = engine->bytes_spliced = engine->syscalls = 0;
+	memset(&engine->latency, 0, sizeof(engine->latency));
+	engine->waiting_first_write = 0;
+	engine->capture = NULL;
+}
+
+static void write_engine_splice_close(write_engine_t *engine);
+static void write_engine_reactor_remove(write_engine_t *engine);
+
+static GstClockTime write_engine_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (GstClockTime)ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+int write_engine_start(write_engine_t *engine)
+{
+	engine->wakeupfd = eventfd(0, EFD_NONBLOCK);
+	if (engine->wakeupfd < 0)
+	{
+		perror("eventfd");
+		return -1;
+	}
+
+	if (engine->use_uring)
+	{
+#ifdef HAVE_IO_URING
+		engine->uring = g_new0(uring_t, 1);
+		if (uring_init(engine->uring, 8) < 0)
+		{
+			GST_WARNING_OBJECT(engine->element, "io_uring not available (%s), using poll", g_strerror(errno));
+			g_free(engine->uring);
+			engine->uring = NULL;
+		}
+		engine->uring_unlock_armed = FALSE;
+#else
+		GST_WARNING_OBJECT(engine->element, "built without io_uring support, using poll");
+#endif
+	}
+
+	if (engine->use_splice)
+	{
+		if (pipe(engine->splicepipe) < 0)
+		{
+			GST_WARNING_OBJECT(engine->element, "no splice pipe (%s), using write", g_strerror(errno));
+			engine->splicepipe[0] = engine->splicepipe[1] = -1;
+		}
+		else
+		{
+			fcntl(engine->splicepipe[0], F_SETFL, O_NONBLOCK);
+			fcntl(engine->splicepipe[1], F_SETFL, O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+			/* room for a whole video frame, so it can be moved with one splice */
+			fcntl(engine->splicepipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+		}
+		engine->splice_pending = 0;
+		engine->splice_checked = FALSE;
+	}
+
+	engine->bytes_written = engine->bytes_spliced = engine->syscalls = 0;
+
+	/* a start is measured like a flush, up to the first write and decoder PTS */
+	GST_OBJECT_LOCK(engine->element);
+	memset(&engine->latency, 0, sizeof(engine->latency));
+	engine->latency.flush_start = engine->latency.flush_stop = write_engine_now();
+	g_atomic_int_set(&engine->waiting_first_write, 1);
+	GST_OBJECT_UNLOCK(engine->element);
+
+	if (engine->threaded || engine->shared_writer)
+	{
+		/* the thread itself is started by the first write, when the device is open */
+		ring_init(&engine->ring, engine->ring_depth);
+		engine->mutex = g_mutex_new();
+		engine->cond = g_cond_new();
+		engine->waiters = engine->writer_waiting = 0;
+		engine->overflow = engine->error = engine->stopping = 0;
+	}
+	return 0;
+}
+
+void write_engine_stop(write_engine_t *engine)
+{
+	if (engine->reactor)
+	{
+		write_engine_reactor_remove(engine);
+	}
+	if (engine->thread)
+	{
+		g_atomic_int_set(&engine->stopping, 1);
+		write_engine_wakeup(engine);
+		g_thread_join(engine->thread);
+		engine->thread = NULL;
+		GST_DEBUG_OBJECT(engine->element, "writer thread stopped");
+	}
+	ring_free(&engine->ring);
+#ifdef HAVE_IO_URING
+	if (engine->uring)
+	{
+		/* before the wakeup eventfd is closed, it might still be polled */
+		uring_exit(engine->uring);
+		g_free(engine->uring);
+		engine->uring = NULL;
+	}
+#endif
+	if (engine->cond)
+	{
+		g_cond_free(engine->cond);
+		engine->cond = NULL;
+	}
+	if (engine->mutex)
+	{
+		g_mutex_free(engine->mutex);
+		engine->mutex = NULL;
+	}
+
+	queue_free(&engine->queue);
+	write_engine_splice_close(engine);
+
+	if (engine->wakeupfd >= 0)
+	{
+		close(engine->wakeupfd);
+		engine->wakeupfd = -1;
+	}
+}
+
+/* wakeup a write blocking in poll, so it rechecks the paused/flushing/unlocking flags */
+void write_engine_wakeup(write_engine_t *engine)
+{
+	if (engine->wakeupfd >= 0)
+	{
+		guint64 one = 1;
+		write(engine->wakeupfd, &one, sizeof(one));
+	}
+	if (engine->mutex)
+	{
+		/* and a render or drain waiting for the writer thread */
+		g_mutex_lock(engine->mutex);
+		g_cond_broadcast(engine->cond);
+		g_mutex_unlock(engine->mutex);
+	}
+}
+
+void write_engine_set_paused(write_engine_t *engine, gboolean paused)
+{
+	g_atomic_int_set(&engine->paused, paused);
+	write_engine_wakeup(engine);
+}
+
+void write_engine_set_flushing(write_engine_t *engine, gboolean flushing)
+{
+	if (flushing)
+	{
+		GST_OBJECT_LOCK(engine->element);
+		memset(&engine->latency, 0, sizeof(engine->latency));
+		engine->latency.flushed = TRUE;
+		engine->latency.flush_start = write_engine_now();
+		GST_OBJECT_UNLOCK(engine->element);
+	}
+	g_atomic_int_set(&engine->flushing, flushing);
+	write_engine_wakeup(engine);
+}
+
+void write_engine_set_unlocking(write_engine_t *engine, gboolean unlocking)
+{
+	g_atomic_int_set(&engine->unlocking, unlocking);
+	write_engine_wakeup(engine);
+}
+
+/* add to one of the counters, only called by whoever writes to the device */
+static void write_engine_count(write_engine_t *engine, guint64 *counter, size_t len)
+{
+	/* odd while updating, see write_engine_get_stats */
+	g_atomic_int_inc(&engine->stats_seq);
+	*counter += len;
+	g_atomic_int_inc(&engine->stats_seq);
+}
+
+/* count a write, poll, splice or io_uring_enter on the device */
+static void write_engine_count_syscall(write_engine_t *engine)
+{
+	write_engine_count(engine, &engine->syscalls, 1);
+}
+
+/* read the counters, from any thread, without locking */
+void write_engine_get_stats(write_engine_t *engine, guint64 *written, guint64 *spliced, guint64 *syscalls)
+{
+	gint seq;
+	do
+	{
+		seq = g_atomic_int_get(&engine->stats_seq);
+		*written = engine->bytes_written;
+		*spliced = engine->bytes_spliced;
+		*syscalls = engine->syscalls;
+	} while ((seq & 1) || seq != g_atomic_int_get(&engine->stats_seq));
+}
+
+/* called by the writer thread when it made progress */
+static void write_engine_signal_waiters(write_engine_t *engine)
+{
+	if (g_atomic_int_get(&engine->waiters))
+	{
+		g_mutex_lock(engine->mutex);
+		g_cond_broadcast(engine->cond);
+		g_mutex_unlock(engine->mutex);
+	}
+}
+
+/* drop everything queued, and end flushing */
+void write_engine_flush(write_engine_t *engine)
+{
+	if (engine->thread || engine->reactor)
+	{
+		/* the writer thread drops the ring contents while flushing */
+		g_mutex_lock(engine->mutex);
+		g_atomic_int_inc(&engine->waiters);
+		while (!ring_is_empty(&engine->ring))
+		{
+			g_cond_wait(engine->cond, engine->mutex);
+		}
+		g_atomic_int_add(&engine->waiters, -1);
+		g_mutex_unlock(engine->mutex);
+	}
+	GST_OBJECT_LOCK(engine->element);
+	queue_clear(&engine->queue);
+	g_atomic_int_set(&engine->overflow, 0);
+	g_atomic_int_set(&engine->flushing, 0);
+	if (engine->latency.flush_start)
+	{
+		engine->latency.flush_stop = write_engine_now();
+		g_atomic_int_set(&engine->waiting_first_write, 1);
+	}
+	GST_OBJECT_UNLOCK(engine->element);
+}
+
+/*
+ * To be called when the decoder reports a PTS (other than 0), posts a
+ * "dvbsink-latency" element message for the last flush or start if this is
+ * the first PTS since, with the ns from the flush (or start) to the end of
+ * the flush, to the first write and to the first PTS.
+ */
+void write_engine_decoder_pts(write_engine_t *engine)
+{
+	GstElement *element = engine->element;
+	write_latency_t latency;
+
+	GST_OBJECT_LOCK(element);
+	if (!engine->latency.first_write || engine->latency.first_pts)
+	{
+		GST_OBJECT_UNLOCK(element);
+		return;
+	}
+	engine->latency.first_pts = write_engine_now();
+	latency = engine->latency;
+	GST_OBJECT_UNLOCK(element);
+
+	GST_DEBUG_OBJECT(element, "%s latency: first write after %" GST_TIME_FORMAT ", first PTS after %" GST_TIME_FORMAT,
+		latency.flushed ? "flush" : "start",
+		GST_TIME_ARGS(latency.first_write - latency.flush_start), GST_TIME_ARGS(latency.first_pts - latency.flush_start));
+	gst_element_post_message(element, gst_message_new_element(GST_OBJECT(element),
+		gst_structure_new("dvbsink-latency",
+			"flushed", G_TYPE_BOOLEAN, latency.flushed,
+			"flush-stop", G_TYPE_UINT64, latency.flush_stop - latency.flush_start,
+			"first-write", G_TYPE_UINT64, latency.first_write - latency.flush_start,
+			"first-pts", G_TYPE_UINT64, latency.first_pts - latency.flush_start,
+			NULL)));
+}
+
+/*
+ * Wait until the writer thread has written everything to the device.
+ * Returns FALSE when interrupted by a flush, unlock or write error.
+ */
+gboolean write_engine_drain(write_engine_t *engine)
+{
+	gboolean drained;
+	if (!engine->thread && !engine->reactor) return TRUE;
+
+	g_mutex_lock(engine->mutex);
+	g_atomic_int_inc(&engine->waiters);
+	while (1)
+	{
+		drained = ring_is_empty(&engine->ring) && !g_atomic_int_get(&engine->overflow);
+		if (drained || g_atomic_int_get(&engine->flushing) || g_atomic_int_get(&engine->unlocking) || g_atomic_int_get(&engine->error)) break;
+		g_cond_wait(engine->cond, engine->mutex);
+	}
+	g_atomic_int_add(&engine->waiters, -1);
+	g_mutex_unlock(engine->mutex);
+	GST_DEBUG_OBJECT(engine->element, "drain %s", drained ? "done" : "interrupted");
+	return drained;
+}
+
+/* reset the eventfd after a wakeup, the reason is in the state flags */
+static void write_engine_clear_wakeup(write_engine_t *engine)
+{
+	guint64 count;
+	if (read(engine->wakeupfd, &count, sizeof(count)) == sizeof(count))
+	{
+		GST_LOG_OBJECT(engine->element, "%llu wakeups", (unsigned long long)count);
+	}
+}
+
+/*
+ * Wait until everything has been written, and the decoder reports its
+ * buffer empty (POLLIN on the device).
+ * Returns FALSE when interrupted by a flush, unlock or write error.
+ * The writer thread and the reactor consume the wakeup eventfd, so with
+ * those they watch the device, and this sleeps on cond until they saw POLLIN.
+ */
+gboolean write_engine_wait_eos(write_engine_t *engine)
+{
+	struct pollfd pfd[2];
+
+	if (!write_engine_drain(engine)) return FALSE;
+	if (engine->thread || engine->reactor)
+	{
+		gboolean empty;
+		g_atomic_int_set(&engine->decoder_empty, 0);
+		g_atomic_int_set(&engine->eos_waiting, 1);
+		/* let the writer add POLLIN to what it polls for */
+		write_engine_wakeup(engine);
+		g_mutex_lock(engine->mutex);
+		g_atomic_int_inc(&engine->waiters);
+		/* the flags are set before the broadcast, so checking them with the mutex held can't miss one */
+		while (!(empty = g_atomic_int_get(&engine->decoder_empty)) && !g_atomic_int_get(&engine->flushing)
+			&& !g_atomic_int_get(&engine->unlocking) && !g_atomic_int_get(&engine->error))
+		{
+			g_cond_wait(engine->cond, engine->mutex);
+		}
+		g_atomic_int_add(&engine->waiters, -1);
+		g_mutex_unlock(engine->mutex);
+		/* the writer drops POLLIN again on its next round */
+		g_atomic_int_set(&engine->eos_waiting, 0);
+		if (!empty)
+		{
+			GST_DEBUG_OBJECT(engine->element, "wait EOS aborted");
+			return FALSE;
+		}
+		GST_DEBUG_OBJECT(engine->element, "got buffer empty from driver");
+		return TRUE;
+	}
+	pfd[0].fd = engine->wakeupfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = engine->fd;
+	pfd[1].events = POLLIN;
+	while (1)
+	{
+		if (g_atomic_int_get(&engine->flushing) || g_atomic_int_get(&engine->unlocking) || g_atomic_int_get(&engine->error))
+		{
+			GST_DEBUG_OBJECT(engine->element, "wait EOS aborted");
+			return FALSE;
+		}
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			GST_ERROR_OBJECT(engine->element, "poll in EOS wait failed: %s", g_strerror(errno));
+			return FALSE;
+		}
+		/* a pause wakes us up too, the flags tell whether to stop waiting */
+		if (pfd[0].revents & POLLIN) write_engine_clear_wakeup(engine);
+		if (pfd[1].revents & POLLIN) break;
+	}
+	GST_DEBUG_OBJECT(engine->element, "got buffer empty from driver");
+	return TRUE;
+}
+
+/*
+ * Decide whether the writer has to wait for the device to become writable.
+ * Sets writer_waiting before looking at the ring, so a push that comes in
+ * after this check wakes up the writer.
+ */
+static gboolean write_engine_writer_idle(write_engine_t *engine)
+{
+	gboolean idle = TRUE;
+
+	g_atomic_int_set(&engine->writer_waiting, 1);
+	if (g_atomic_int_get(&engine->flushing) || g_atomic_int_get(&engine->error))
+	{
+		ring_clear(&engine->ring);
+		write_engine_signal_waiters(engine);
+	}
+	else if (!g_atomic_int_get(&engine->paused))
+	{
+		idle = ring_is_empty(&engine->ring) && !g_atomic_int_get(&engine->overflow);
+	}
+	if (!idle) g_atomic_int_set(&engine->writer_waiting, 0);
+	return idle;
+}
+
+/* handle the poll events of the device, for the writer thread and the reactor */
+static void write_engine_writer_ready(write_engine_t *engine, short revents)
+{
+	GstElement *element = engine->element;
+
+	if (revents & POLLPRI)
+	{
+		engine->event_hook(element);
+	}
+	/* only once per EOS wait, POLLIN stays set while the buffer is empty */
+	if ((revents & POLLIN) && g_atomic_int_compare_and_exchange(&engine->eos_waiting, 1, 0))
+	{
+		g_atomic_int_set(&engine->decoder_empty, 1);
+		write_engine_signal_waiters(engine);
+	}
+	if (revents & POLLOUT)
+	{
+		ssize_t wr;
+		/* whatever is in the ring is older than the overflow queue */
+		if (!ring_is_empty(&engine->ring))
+		{
+			wr = ring_write(&engine->ring, engine->fd);
+		}
+		else
+		{
+			GST_OBJECT_LOCK(element);
+			wr = queue_write(&engine->queue, engine->fd);
+			if (!engine->queue.head) g_atomic_int_set(&engine->overflow, 0);
+			GST_OBJECT_UNLOCK(element);
+		}
+		write_engine_count_syscall(engine);
+		if (wr > 0) write_engine_count(engine, &engine->bytes_written, wr);
+		if (wr < 0 && errno != EINTR && errno != EAGAIN)
+		{
+			GST_ERROR_OBJECT(element, "write failed: %s", g_strerror(errno));
+			g_atomic_int_set(&engine->error, 1);
+		}
+		write_engine_signal_waiters(engine);
+	}
+}
+
+static gpointer write_engine_thread(gpointer data)
+{
+	write_engine_t *engine = data;
+	GstElement *element = engine->element;
+	struct pollfd pfd[2];
+
+	GST_DEBUG_OBJECT(element, "writer thread started");
+	while (!g_atomic_int_get(&engine->stopping))
+	{
+		pfd[0].fd = engine->wakeupfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = engine->fd;
+		pfd[1].events = engine->event_hook ? POLLPRI : 0;
+		if (!write_engine_writer_idle(engine)) pfd[1].events |= POLLOUT;
+		if (g_atomic_int_get(&engine->eos_waiting)) pfd[1].events |= POLLIN;
+
+		write_engine_count_syscall(engine);
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			GST_ERROR_OBJECT(element, "poll failed: %s", g_strerror(errno));
+			g_atomic_int_set(&engine->error, 1);
+			write_engine_signal_waiters(engine);
+			continue;
+		}
+		g_atomic_int_set(&engine->writer_waiting, 0);
+		if (pfd[0].revents & POLLIN)
+		{
+			write_engine_clear_wakeup(engine);
+			continue;
+		}
+		write_engine_writer_ready(engine, pfd[1].revents);
+	}
+	GST_DEBUG_OBJECT(element, "writer thread exits");
+	return NULL;
+}
+
+/*
+ * The reactor: one epoll thread that does the work of the writer thread for
+ * all engines with shared_writer set, so several sinks don't need a thread each.
+ * It polls the wakeup eventfd of every engine, and the device for POLLPRI,
+ * for POLLOUT only while the engine has data to write, and for POLLIN
+ * only during an EOS wait.
+ */
+typedef struct reactor
+{
+	int epfd;
+	/* wakes up the reactor itself, to stop it */
+	int wakeupfd;
+	GThread *thread;
+	/* held while handling events, engines are only removed with this held */
+	GMutex *mutex;
+	GList *engines;
+	int refcount;
+	volatile gint stopping;
+} reactor_t;
+
+/* epoll data of an engine wakeup fd, the device fd has the plain engine pointer,
+ * the reactor wakeup fd has 0 */
+#define REACTOR_WAKEUP 1
+
+G_LOCK_DEFINE_STATIC(reactor);
+static reactor_t *reactor;
+
+/* (re)register the device of an engine for the events it needs now, called with the reactor mutex */
+static void reactor_update(reactor_t *r, write_engine_t *engine)
+{
+	struct epoll_event ev;
+	int events = 0;
+
+	if (!write_engine_writer_idle(engine)) events |= EPOLLOUT;
+	if (engine->event_hook) events |= EPOLLPRI;
+	if (g_atomic_int_get(&engine->eos_waiting)) events |= EPOLLIN;
+	/* a broken device would keep reporting EPOLLERR */
+	if (g_atomic_int_get(&engine->error)) events = 0;
+	if (engine->reactor_nopoll)
+	{
+		/* like poll(), a file always reads as ready */
+		if (events & EPOLLIN) write_engine_writer_ready(engine, POLLIN);
+		/* come back through the wakeup eventfd until everything has been written */
+		if (events & EPOLLOUT)
+		{
+			guint64 one = 1;
+			write(engine->wakeupfd, &one, sizeof(one));
+		}
+		return;
+	}
+	if (events == engine->reactor_events) return;
+
+	ev.events = events;
+	ev.data.u64 = (gsize)engine;
+	if (!events)
+	{
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, engine->fd, &ev);
+		engine->reactor_events = -1;
+		return;
+	}
+	if (epoll_ctl(r->epfd, engine->reactor_events < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, engine->fd, &ev) < 0)
+	{
+		if (errno == EPERM && engine->reactor_events < 0)
+		{
+			GST_DEBUG_OBJECT(engine->element, "device can't be polled, treating it as always writable");
+			engine->reactor_nopoll = TRUE;
+			reactor_update(r, engine);
+			return;
+		}
+		GST_ERROR_OBJECT(engine->element, "can't poll device: %s", g_strerror(errno));
+		g_atomic_int_set(&engine->error, 1);
+		write_engine_signal_waiters(engine);
+		return;
+	}
+	engine->reactor_events = events;
+}
+
+static gpointer reactor_thread(gpointer data)
+{
+	reactor_t *r = data;
+	struct epoll_event events[16];
+
+	GST_DEBUG("reactor started");
+	while (!g_atomic_int_get(&r->stopping))
+	{
+		int i, n = epoll_wait(r->epfd, events, G_N_ELEMENTS(events), -1);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			GST_ERROR("epoll_wait failed: %s", g_strerror(errno));
+			break;
+		}
+		g_mutex_lock(r->mutex);
+		for (i = 0; i < n; i++)
+		{
+			gsize tag = events[i].data.u64;
+			write_engine_t *engine = (write_engine_t*)(tag & ~(gsize)REACTOR_WAKEUP);
+			guint32 ev = events[i].events;
+
+			/* might have been removed after epoll_wait returned */
+			if (!engine || !g_list_find(r->engines, engine)) continue;
+			if (tag & REACTOR_WAKEUP)
+			{
+				write_engine_clear_wakeup(engine);
+				if (engine->reactor_nopoll && !write_engine_writer_idle(engine))
+				{
+					write_engine_writer_ready(engine, POLLOUT);
+				}
+			}
+			else if (ev & (EPOLLERR | EPOLLHUP))
+			{
+				GST_ERROR_OBJECT(engine->element, "device error");
+				g_atomic_int_set(&engine->error, 1);
+				write_engine_signal_waiters(engine);
+			}
+			else
+			{
+				write_engine_writer_ready(engine, ((ev & EPOLLOUT) ? POLLOUT : 0) | ((ev & EPOLLPRI) ? POLLPRI : 0)
+					| ((ev & EPOLLIN) ? POLLIN : 0));
+			}
+			reactor_update(r, engine);
+		}
+		g_mutex_unlock(r->mutex);
+	}
+	GST_DEBUG("reactor exits");
+	return NULL;
+}
+
+static void reactor_free(reactor_t *r)
+{
+	if (r->epfd >= 0) close(r->epfd);
+	if (r->wakeupfd >= 0) close(r->wakeupfd);
+	if (r->mutex) g_mutex_free(r->mutex);
+	g_free(r);
+}
+
+/* get a reference on the reactor, starting it when needed */
+static reactor_t *reactor_get(void)
+{
+	reactor_t *r;
+
+	G_LOCK(reactor);
+	if (!reactor)
+	{
+		struct epoll_event ev;
+		r = g_new0(reactor_t, 1);
+		r->epfd = epoll_create(16);
+		r->wakeupfd = eventfd(0, EFD_NONBLOCK);
+		r->mutex = g_mutex_new();
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		if (r->epfd < 0 || r->wakeupfd < 0 || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakeupfd, &ev) < 0 ||
+			!(r->thread = g_thread_create(reactor_thread, r, TRUE, NULL)))
+		{
+			GST_WARNING("failed to start the reactor");
+			reactor_free(r);
+			G_UNLOCK(reactor);
+			return NULL;
+		}
+		reactor = r;
+	}
+	r = reactor;
+	r->refcount++;
+	G_UNLOCK(reactor);
+	return r;
+}
+
+/* drop a reference on the reactor, the last one stops it */
+static void reactor_put(reactor_t *r)
+{
+	G_LOCK(reactor);
+	if (--r->refcount == 0)
+	{
+		guint64 one = 1;
+		g_atomic_int_set(&r->stopping, 1);
+		write(r->wakeupfd, &one, sizeof(one));
+		g_thread_join(r->thread);
+		reactor_free(r);
+		reactor = NULL;
+	}
+	G_UNLOCK(reactor);
+}
+
+/* hand the engine to the reactor, it writes the ring from now on */
+static gboolean write_engine_reactor_add(write_engine_t *engine)
+{
+	struct epoll_event ev;
+	reactor_t *r = reactor_get();
+
+	if (!r) return FALSE;
+	g_mutex_lock(r->mutex);
+	ev.events = EPOLLIN;
+	ev.data.u64 = (gsize)engine | REACTOR_WAKEUP;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, engine->wakeupfd, &ev) < 0)
+	{
+		g_mutex_unlock(r->mutex);
+		reactor_put(r);
+		return FALSE;
+	}
+	r->engines = g_list_prepend(r->engines, engine);
+	engine->reactor = r;
+	engine->reactor_events = -1;
+	engine->reactor_nopoll = FALSE;
+	reactor_update(r, engine);
+	g_mutex_unlock(r->mutex);
+	GST_DEBUG_OBJECT(engine->element, "added to the reactor");
+	return TRUE;
+}
+
+static void write_engine_reactor_remove(write_engine_t *engine)
+{
+	reactor_t *r = engine->reactor;
+	struct epoll_event ev;
+
+	g_mutex_lock(r->mutex);
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, engine->wakeupfd, &ev);
+	if (engine->reactor_events >= 0) epoll_ctl(r->epfd, EPOLL_CTL_DEL, engine->fd, &ev);
+	r->engines = g_list_remove(r->engines, engine);
+	g_mutex_unlock(r->mutex);
+	engine->reactor = NULL;
+	reactor_put(r);
+	GST_DEBUG_OBJECT(engine->element, "removed from the reactor");
+}
+
+/* wait until the writer thread made room for more data, or we have to stop waiting */
+static void write_engine_wait_room(write_engine_t *engine)
+{
+	g_mutex_lock(engine->mutex);
+	g_atomic_int_inc(&engine->waiters);
+	while (!g_atomic_int_get(&engine->flushing) && !g_atomic_int_get(&engine->unlocking) && !g_atomic_int_get(&engine->error))
+	{
+		gboolean full;
+		if (g_atomic_int_get(&engine->overflow))
+		{
+			GST_OBJECT_LOCK(engine->element);
+			full = queue_is_full(&engine->queue);
+			GST_OBJECT_UNLOCK(engine->element);
+		}
+		else
+		{
+			full = ring_is_full(&engine->ring);
+		}
+		if (!full) break;
+		g_cond_wait(engine->cond, engine->mutex);
+	}
+	g_atomic_int_add(&engine->waiters, -1);
+	g_mutex_unlock(engine->mutex);
+}
+
+/* writer thread mode: hand the segments to the writer thread */
+static int write_engine_push(write_engine_t *engine, write_segment_t *segments, int count)
+{
+	GstElement *element = engine->element;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		GstBuffer *buffer = segments[i].buffer;
+		size_t start, len = segments[i].len;
+		int ret = 0;
+		if (!len) continue;
+		if (buffer)
+		{
+			gst_buffer_ref(buffer);
+			start = segments[i].data - GST_BUFFER_DATA(buffer);
+		}
+		else
+		{
+			/* the data won't be valid anymore when the writer thread gets to it, keep a copy */
+			buffer = gst_buffer_new_and_alloc(len);
+			memcpy(GST_BUFFER_DATA(buffer), segments[i].data, len);
+			start = 0;
+		}
+		while (1)
+		{
+			if (g_atomic_int_get(&engine->flushing))
+			{
+				GST_DEBUG_OBJECT(element, "flushing, skip %d bytes", segments_size(&segments[i], count - i));
+				ret = 1;
+				break;
+			}
+			if (g_atomic_int_get(&engine->error))
+			{
+				ret = -3;
+				break;
+			}
+			if (!g_atomic_int_get(&engine->overflow))
+			{
+				if (ring_push(&engine->ring, buffer, start, start + len)) break;
+				if (g_atomic_int_get(&engine->unlocking))
+				{
+					/* we may not block now, keep the data aside until the writer thread catches up */
+					GST_OBJECT_LOCK(element);
+					queue_push(&engine->queue, buffer, start, start + len);
+					g_atomic_int_set(&engine->overflow, 1);
+					GST_OBJECT_UNLOCK(element);
+					break;
+				}
+			}
+			else
+			{
+				/* keep using the queue until the writer thread emptied it, to keep the data in order */
+				gboolean pushed = FALSE;
+				GST_OBJECT_LOCK(element);
+				if (g_atomic_int_get(&engine->unlocking) || !queue_is_full(&engine->queue))
+				{
+					queue_push(&engine->queue, buffer, start, start + len);
+					g_atomic_int_set(&engine->overflow, 1);
+					pushed = TRUE;
+				}
+				GST_OBJECT_UNLOCK(element);
+				if (pushed) break;
+			}
+			GST_LOG_OBJECT(element, "no room, waiting for the writer thread");
+			/* with more segments than the ring holds, it is full before the writer got woken up below */
+			if (g_atomic_int_get(&engine->writer_waiting)) write_engine_wakeup(engine);
+			write_engine_wait_room(engine);
+		}
+		gst_buffer_unref(buffer);
+		if (ret < 0) return ret;
+		if (ret) break;
+	}
+
+	if (g_atomic_int_get(&engine->writer_waiting))
+	{
+		write_engine_wakeup(engine);
+	}
+	return 0;
+}
+
+/* drop the pipe contents, and the references on the pages in it */
+static void write_engine_splice_release(write_engine_t *engine)
+{
+	if (engine->splice_pending)
+	{
+		char scratch[4096];
+		/* the segments these bytes came from have not been consumed, they are written again later */
+		while (read(engine->splicepipe[0], scratch, sizeof(scratch)) > 0);
+		engine->splice_pending = 0;
+	}
+	while (engine->splice_nbuffers)
+	{
+		gst_buffer_unref(engine->splice_buffers[--engine->splice_nbuffers]);
+	}
+}
+
+static void write_engine_splice_close(write_engine_t *engine)
+{
+	if (engine->splicepipe[0] < 0) return;
+	/* closing the pipe lets go of the pages, only then the buffers can be released */
+	close(engine->splicepipe[1]);
+	close(engine->splicepipe[0]);
+	engine->splicepipe[0] = engine->splicepipe[1] = -1;
+	engine->splice_pending = 0;
+	write_engine_splice_release(engine);
+}
+
+/*
+ * Write (a part of) the segments without copying: vmsplice maps their pages
+ * into the pipe, splice moves them on to the device. The pipe references the
+ * pages until they have been spliced out, so the buffers are kept referenced
+ * until then. Segments without a buffer are only valid during write_engine_write,
+ * which empties the pipe before it returns.
+ * Returns the number of bytes that reached the device.
+ */
+static ssize_t write_engine_splice(write_engine_t *engine, const write_segment_t *segments, int count)
+{
+	ssize_t wr;
+
+	if (!engine->splice_pending)
+	{
+		struct iovec iov[WRITE_MAX_IOV];
+		size_t mapped = 0;
+		int i;
+
+		count = segments_fill_iov(segments, count, iov, WRITE_MAX_IOV);
+		wr = vmsplice(engine->splicepipe[1], iov, count, SPLICE_F_NONBLOCK);
+		write_engine_count_syscall(engine);
+		if (wr <= 0) return wr;
+		engine->splice_pending = wr;
+		for (i = 0; i < count && mapped < (size_t)wr; i++)
+		{
+			if (segments[i].buffer)
+			{
+				engine->splice_buffers[engine->splice_nbuffers++] = gst_buffer_ref(segments[i].buffer);
+			}
+			mapped += segments[i].len;
+		}
+	}
+
+	wr = splice(engine->splicepipe[0], NULL, engine->fd, NULL, engine->splice_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	write_engine_count_syscall(engine);
+	if (wr > 0)
+	{
+		engine->splice_pending -= wr;
+		if (!engine->splice_pending) write_engine_splice_release(engine);
+	}
+	return wr;
+}
+
+/* write (a part of) the segments, through the splice pipe when it is enabled and worth it,
+ * otherwise all segments go out in a single writev */
+static ssize_t write_engine_write_segments(write_engine_t *engine, const write_segment_t *segments, int count)
+{
+	GstElement *element = engine->element;
+	ssize_t wr;
+
+	if (engine->splicepipe[0] >= 0 && !engine->splice_checked)
+	{
+		struct stat st;
+		engine->splice_checked = TRUE;
+		/* a pipe or socket takes over the pages instead of copying them,
+		 * and would still use them after the buffers have been released */
+		if (fstat(engine->fd, &st) < 0 || !(S_ISCHR(st.st_mode) || S_ISREG(st.st_mode)))
+		{
+			GST_WARNING_OBJECT(element, "device can't splice safely, using write");
+			write_engine_splice_close(engine);
+		}
+	}
+	if (engine->splicepipe[0] >= 0 && (engine->splice_pending || segments_size(segments, count) >= SPLICE_MIN_BYTES))
+	{
+		wr = write_engine_splice(engine, segments, count);
+		if (wr > 0) write_engine_count(engine, &engine->bytes_spliced, wr);
+		if (wr >= 0 || errno == EAGAIN || errno == EINTR) return wr;
+		/* usually EINVAL, when the driver has no splice support */
+		GST_WARNING_OBJECT(element, "splice failed (%s), falling back to write", g_strerror(errno));
+		write_engine_splice_close(engine);
+	}
+
+	wr = segments_write(engine->fd, segments, count);
+	write_engine_count_syscall(engine);
+	if (wr > 0) write_engine_count(engine, &engine->bytes_written, wr);
+	return wr;
+}
+
+/* wait until the device is writable, and write either queued data or (a part of) the segments */
+static int write_engine_poll_step(write_engine_t *engine, struct pollfd *pfd, write_segment_t **segments, int *count)
+{
+	GstElement *element = engine->element;
+
+	write_engine_count_syscall(engine);
+	if (poll(pfd, 2, -1) < 0)
+	{
+		if (errno == EINTR) return 0;
+		return -1;
+	}
+	if (pfd[0].revents & POLLIN)
+	{
+		write_engine_clear_wakeup(engine);
+		return 0;
+	}
+	if (pfd[1].revents & POLLPRI)
+	{
+		engine->event_hook(element);
+	}
+	if (pfd[1].revents & POLLOUT)
+	{
+		int wr;
+		/* only render pushes to the queue in this mode, so no lock is needed
+		 * to find it empty, which it almost always is while playing */
+		if (!queue_is_empty(&engine->queue))
+		{
+			GST_OBJECT_LOCK(element);
+			wr = queue_write(&engine->queue, engine->fd);
+			write_engine_count_syscall(engine);
+			if (wr < 0)
+			{
+				switch (errno)
+				{
+					case EINTR:
+					case EAGAIN:
+						break;
+					default:
+						GST_OBJECT_UNLOCK(element);
+						return -3;
+				}
+			}
+			GST_OBJECT_UNLOCK(element);
+			if (wr > 0)
+			{
+				GST_DEBUG_OBJECT(element, "written %d queue bytes", wr);
+				write_engine_count(engine, &engine->bytes_written, wr);
+			}
+			return 0;
+		}
+		wr = write_engine_write_segments(engine, *segments, *count);
+		if (wr < 0)
+		{
+			switch (errno)
+			{
+				case EINTR:
+				case EAGAIN:
+					return 0;
+				default:
+					return -3;
+			}
+		}
+		segments_consume(segments, count, wr);
+	}
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+enum
+{
+	URING_UNLOCK = 1,
+	URING_POLL,
+	URING_WRITE,
+	URING_CANCEL
+};
+
+/*
+ * Same as write_engine_poll_step, but through io_uring: a poll on the device
+ * linked to the writev, and the wakeup eventfd polled in the same ring.
+ * All completions that are ready get reaped in one go.
+ */
+static int write_engine_uring_step(write_engine_t *engine, write_segment_t **segments, int *count)
+{
+	GstElement *element = engine->element;
+	uring_t *uring = engine->uring;
+	struct iovec iov[WRITE_MAX_IOV];
+	struct io_uring_cqe *cqes[8];
+	struct io_uring_sqe *sqe;
+	gboolean from_queue, unlocked = FALSE, cancelled = FALSE;
+	int iovcnt, inflight = 2, ret = 0;
+
+	/* the queue is only changed from this thread, or while we're not writing */
+	iovcnt = 0;
+	if (!queue_is_empty(&engine->queue))
+	{
+		GST_OBJECT_LOCK(element);
+		iovcnt = queue_fill_iov(&engine->queue, iov, WRITE_MAX_IOV);
+		GST_OBJECT_UNLOCK(element);
+	}
+	from_queue = iovcnt > 0;
+	if (!from_queue) iovcnt = segments_fill_iov(*segments, *count, iov, WRITE_MAX_IOV);
+
+	if (!engine->uring_unlock_armed)
+	{
+		sqe = uring_get_sqe(uring);
+		uring_prep_poll_add(sqe, engine->wakeupfd, POLLIN, URING_UNLOCK);
+		engine->uring_unlock_armed = TRUE;
+	}
+	sqe = uring_get_sqe(uring);
+	uring_prep_poll_add(sqe, engine->fd, POLLOUT | (engine->event_hook ? POLLPRI : 0), URING_POLL);
+	sqe->flags |= IOSQE_IO_LINK;
+	sqe = uring_get_sqe(uring);
+	uring_prep_writev(sqe, engine->fd, iov, iovcnt, URING_WRITE);
+
+	/* don't return before the writev completed, it uses iov and the buffer data */
+	while (inflight > 0)
+	{
+		unsigned i, n;
+		write_engine_count_syscall(engine);
+		if (uring_submit_and_wait(uring, 1) < 0)
+		{
+			GST_ERROR_OBJECT(element, "io_uring_enter failed: %s", g_strerror(errno));
+			return -1;
+		}
+		n = uring_peek_batch(uring, cqes, G_N_ELEMENTS(cqes));
+		for (i = 0; i < n; i++)
+		{
+			int res = cqes[i]->res;
+			switch (cqes[i]->user_data)
+			{
+			case URING_UNLOCK:
+				engine->uring_unlock_armed = FALSE;
+				unlocked = TRUE;
+				break;
+			case URING_POLL:
+				inflight--;
+				if (res > 0 && (res & POLLPRI)) engine->event_hook(element);
+				break;
+			case URING_WRITE:
+				inflight--;
+				if (res > 0)
+				{
+					if (from_queue)
+					{
+						GST_OBJECT_LOCK(element);
+						queue_consume(&engine->queue, res);
+						GST_OBJECT_UNLOCK(element);
+						GST_DEBUG_OBJECT(element, "written %d queue bytes", res);
+					}
+					else
+					{
+						segments_consume(segments, count, res);
+					}
+					write_engine_count(engine, &engine->bytes_written, res);
+				}
+				else if (res < 0 && res != -EAGAIN && res != -EINTR && res != -ECANCELED)
+				{
+					errno = -res;
+					ret = -3;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+		uring_cq_advance(uring, n);
+		if (unlocked && inflight > 0 && !cancelled)
+		{
+			/* stop waiting for the device, cancelling the poll also cancels the linked writev */
+			sqe = uring_get_sqe(uring);
+			uring_prep_cancel(sqe, URING_POLL, URING_CANCEL);
+			cancelled = TRUE;
+		}
+	}
+	if (unlocked) write_engine_clear_wakeup(engine);
+	return ret;
+}
+#endif
+
+/*
+ * Write the segments to the device, after whatever is still queued.
+ * Blocks until everything has been written, unless the sink is paused or
+ * unlocking (then the remaining data gets queued) or flushing (then it is dropped).
+ * Returns 0 on success, or a negative value on poll or write errors.
+ */
+int write_engine_write(write_engine_t *engine, write_segment_t *segments, int count)
+{
+	GstElement *element = engine->element;
+	struct pollfd pfd[2];
+	int ret = 0;
+
+	/* record what the device gets, which is nothing while flushing */
+	if (engine->capture && !g_atomic_int_get(&engine->flushing))
+	{
+		capture_write(engine->capture, segments, count);
+	}
+
+	if (g_atomic_int_get(&engine->waiting_first_write))
+	{
+		GST_OBJECT_LOCK(element);
+		/* unless a new flush started meanwhile */
+		if (engine->latency.flush_stop && !engine->latency.first_write)
+		{
+			engine->latency.first_write = write_engine_now();
+		}
+		g_atomic_int_set(&engine->waiting_first_write, 0);
+		GST_OBJECT_UNLOCK(element);
+	}
+
+	if (engine->ring.entries)
+	{
+		if (!engine->thread && !engine->reactor)
+		{
+			if (engine->shared_writer)
+			{
+				write_engine_reactor_add(engine);
+			}
+			else
+			{
+				engine->thread = g_thread_create(write_engine_thread, engine, TRUE, NULL);
+			}
+		}
+		if (engine->thread || engine->reactor)
+		{
+			return write_engine_push(engine, segments, count);
+		}
+		GST_WARNING_OBJECT(element, "failed to start writer thread, writing from the streaming thread");
+		ring_free(&engine->ring);
+	}
+
+	pfd[0].fd = engine->wakeupfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = engine->fd;
+	pfd[1].events = POLLOUT;
+	if (engine->event_hook) pfd[1].events |= POLLPRI;
+
+	while (count > 0)
+	{
+		if (g_atomic_int_get(&engine->flushing))
+		{
+			GST_DEBUG_OBJECT(element, "flushing, skip %d bytes", segments_size(segments, count));
+			break;
+		}
+		else if (g_atomic_int_get(&engine->paused) || g_atomic_int_get(&engine->unlocking))
+		{
+			GST_OBJECT_LOCK(element);
+			if (!g_atomic_int_get(&engine->unlocking) && queue_is_full(&engine->queue))
+			{
+				/* don't let the queue grow any further, wait until we resume, flush or get unlocked */
+				GST_OBJECT_UNLOCK(element);
+				GST_DEBUG_OBJECT(element, "queue full, waiting to push %d bytes", segments_size(segments, count));
+				write_engine_count_syscall(engine);
+				if (poll(pfd, 1, -1) < 0 && errno != EINTR) return -1;
+				if (pfd[0].revents & POLLIN) write_engine_clear_wakeup(engine);
+				continue;
+			}
+			queue_push_segments(&engine->queue, segments, count);
+			GST_OBJECT_UNLOCK(element);
+			GST_DEBUG_OBJECT(element, "pushed %d bytes to queue", segments_size(segments, count));
+			break;
+		}
+		else
+		{
+			GST_LOG_OBJECT(element, "going into poll, have %d bytes to write", segments_size(segments, count));
+		}
+#ifdef HAVE_IO_URING
+		if (engine->uring)
+		{
+			ret = write_engine_uring_step(engine, &segments, &count);
+		}
+		else
+#endif
+		{
+			ret = write_engine_poll_step(engine, pfd, &segments, &count);
+		}
+		if (ret < 0) break;
+	}
+
+	/* whatever is left in the pipe is written again, or dropped, with the remaining segments */
+	if (engine->splice_pending) write_engine_splice_release(engine);
+
+	return ret < 0 ? ret : 0;
+}
+
 void pes_set_pts(long long timestamp, unsigned char *pes_header)
 {
 	unsigned long long pts = timestamp * 9LL / 100000; /* convert ns to 90kHz */
@@ -1,6 +1,13 @@
 #ifndef _common_h
 #define _common_h
 
+struct iovec;
+struct uring;
+struct reactor;
+struct capture;
+
+#define WRITE_MAX_IOV 64
+
 typedef struct queue_entry
 {
 	GstBuffer *buffer;
@@ -9,11 +16,181 @@ typedef struct queue_entry
 	size_t end;
 } queue_entry_t;
 
-void queue_push(queue_entry_t **queue_base, GstBuffer *buffer, size_t start, size_t end);
-void queue_pop(queue_entry_t **queue_base);
-int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, size_t *end);
+typedef struct queue
+{
+	queue_entry_t *head;
+	queue_entry_t *tail;
+	/* popped entries are kept here for reuse, to avoid a malloc per push */
+	queue_entry_t *pool;
+	/* number of bytes waiting in the queue */
+	size_t bytes;
+	/* full is set when bytes reaches the high watermark, and cleared again
+	 * when the queue has been drained down to the low watermark.
+	 * A high watermark of 0 means the queue is unbounded */
+	size_t high_watermark;
+	size_t low_watermark;
+	gboolean full;
+} queue_t;
+
+/* a piece of data to be written to the device, data points into buffer,
+ * or buffer is NULL when data is only valid for the duration of the write call
+ * (it will be copied when it needs to be queued) */
+typedef struct write_segment
+{
+	GstBuffer *buffer;
+	const guint8 *data;
+	size_t len;
+} write_segment_t;
+
+/* single producer, single consumer ring of buffer references,
+ * head is only advanced by the consumer, tail only by the producer */
+typedef struct ring
+{
+	queue_entry_t *entries;
+	guint mask;
+	volatile gint head;
+	volatile gint tail;
+} ring_t;
+
+/* when a flush (or the start) happened and how long it took the device to
+ * get going again after it, for measuring zap and seek latency.
+ * CLOCK_MONOTONIC times in ns, 0 for what didn't happen yet */
+typedef struct write_latency
+{
+	gboolean flushed;
+	GstClockTime flush_start;
+	GstClockTime flush_stop;
+	GstClockTime first_write;
+	GstClockTime first_pts;
+} write_latency_t;
+
+/* the part of a sink that feeds a decoder device: the device fd, the
+ * eventfd used to wakeup a blocking write, and the queue that
+ * collects data while paused */
+typedef struct write_engine
+{
+	/* the sink owning this engine, used for locking and debug output */
+	GstElement *element;
+	int fd;
+	int wakeupfd;
+	queue_t queue;
+	/* only accessed atomically, change them with write_engine_set_*,
+	 * which also wakes up the writer */
+	volatile gint paused, flushing, unlocking;
+	/* called when the device has an event pending (POLLPRI), may be NULL */
+	void (*event_hook)(GstElement *element);
+
+	/* writer thread mode: render only fills the ring, a dedicated thread
+	 * writes it out to the device. Settings take effect on the next start */
+	gboolean threaded;
+	guint ring_depth;
+	ring_t ring;
+	GThread *thread;
+	GMutex *mutex;
+	GCond *cond;
+	/* number of threads waiting on cond for the writer thread to make progress */
+	volatile gint waiters;
+	/* the writer thread is idle, and wants a wakeup when new data arrives */
+	volatile gint writer_waiting;
+	/* the EOS wait wants to know when the decoder buffer runs empty, the writer
+	 * thread or the reactor then also polls the device for POLLIN, and sets
+	 * decoder_empty when it comes */
+	volatile gint eos_waiting, decoder_empty;
+	/* data went to queue because the ring was full while unlocking,
+	 * the ring can only be used again after the queue has been written */
+	volatile gint overflow;
+	volatile gint error;
+	volatile gint stopping;
+
+	/* like threaded, but the ring is written by one thread shared by all
+	 * engines with this set. Takes effect on the next start */
+	gboolean shared_writer;
+	struct reactor *reactor;
+	/* events the device is registered for with the reactor, -1 if not at all */
+	int reactor_events;
+	/* the device can't be polled (a regular file or /dev/null), it is always
+	 * writable, and written whenever the wakeup eventfd is signalled */
+	gboolean reactor_nopoll;
+
+	/* write from render through io_uring instead of poll and writev,
+	 * when the kernel supports it. Takes effect on the next start */
+	gboolean use_uring;
+	struct uring *uring;
+	gboolean uring_unlock_armed;
+
+	/* move data from render to the device with vmsplice and splice instead
+	 * of writev, falls back to writev when the device can't splice.
+	 * Takes effect on the next start */
+	gboolean use_splice;
+	int splicepipe[2];
+	/* the device has been checked to copy spliced data */
+	gboolean splice_checked;
+	/* bytes in the pipe, not yet spliced to the device */
+	size_t splice_pending;
+	/* references on the buffers with pages in the pipe */
+	GstBuffer *splice_buffers[WRITE_MAX_IOV];
+	int splice_nbuffers;
+
+	/* bytes that reached the device through writev and splice since start,
+	 * and the system calls made on the device for it (the shared writer's
+	 * epoll_wait is not counted), read them with write_engine_get_stats */
+	guint64 bytes_written;
+	guint64 bytes_spliced;
+	guint64 syscalls;
+	volatile gint stats_seq;
+
+	/* protected by the object lock, waiting_first_write is set while
+	 * first_write is still to be recorded, so writes can check it without locking */
+	write_latency_t latency;
+	volatile gint waiting_first_write;
+
+	/* records everything handed to write_engine_write when set, see capture.h */
+	struct capture *capture;
+} write_engine_t;
+
+void queue_init(queue_t *queue);
+void queue_clear(queue_t *queue);
+void queue_free(queue_t *queue);
+void queue_push(queue_t *queue, GstBuffer *buffer, size_t start, size_t end);
+void queue_pop(queue_t *queue);
+void queue_advance(queue_t *queue, size_t len);
+void queue_set_watermarks(queue_t *queue, size_t high, size_t low);
+gboolean queue_is_full(queue_t *queue);
+gboolean queue_is_empty(queue_t *queue);
+int queue_front(queue_t *queue, GstBuffer **buffer, size_t *start, size_t *end);
+void queue_push_segments(queue_t *queue, const write_segment_t *segments, int count);
+int queue_fill_iov(queue_t *queue, struct iovec *iov, int max);
+void queue_consume(queue_t *queue, size_t len);
+ssize_t queue_write(queue_t *queue, int fd);
+
+size_t segments_size(const write_segment_t *segments, int count);
+int segments_fill_iov(const write_segment_t *segments, int count, struct iovec *iov, int max);
+ssize_t segments_write(int fd, const write_segment_t *segments, int count);
+void segments_consume(write_segment_t **segments, int *count, size_t len);
+
+void ring_init(ring_t *ring, guint depth);
+void ring_free(ring_t *ring);
+gboolean ring_is_empty(ring_t *ring);
+gboolean ring_is_full(ring_t *ring);
+gboolean ring_push(ring_t *ring, GstBuffer *buffer, size_t start, size_t end);
+void ring_clear(ring_t *ring);
+ssize_t ring_write(ring_t *ring, int fd);
+
+void write_engine_init(write_engine_t *engine, GstElement *element, void (*event_hook)(GstElement *element));
+int write_engine_start(write_engine_t *engine);
+void write_engine_stop(write_engine_t *engine);
+void write_engine_wakeup(write_engine_t *engine);
+void write_engine_set_paused(write_engine_t *engine, gboolean paused);
+void write_engine_set_flushing(write_engine_t *engine, gboolean flushing);
+void write_engine_set_unlocking(write_engine_t *engine, gboolean unlocking);
+void write_engine_flush(write_engine_t *engine);
+gboolean write_engine_drain(write_engine_t *engine);
+gboolean write_engine_wait_eos(write_engine_t *engine);
+void write_engine_get_stats(write_engine_t *engine, guint64 *written, guint64 *spliced, guint64 *syscalls);
+int write_engine_write(write_engine_t *engine, write_segment_t *segments, int count);
+void write_engine_decoder_pts(write_engine_t *engine);
 
 void pes_set_pts(long long timestamp, unsigned char *pes_header);
 void pes_set_payload_size(size_t size, unsigned char *pes_header);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,903 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/dvb/audio.h>
+#include <linux/dvb/video.h>
+
+#include <gst/gst.h>
+
+#include "device.h"
+#include "capture.h"
+
+struct device_ops
+{
+	int (*open)(device_t *device, const char *path);
+	void (*close)(device_t *device);
+	int (*ioctl)(device_t *device, unsigned long request, unsigned long arg);
+};
+
+GType device_backend_get_type(void)
+{
+	static GType type = 0;
+	if (!type)
+	{
+		static const GEnumValue values[] =
+		{
+			{ DEVICE_BACKEND_DVB, "DVB decoder device", "dvb" },
+			{ DEVICE_BACKEND_FILE, "Regular file or FIFO", "file" },
+			{ DEVICE_BACKEND_MOCK, "In-process decoder stand-in", "mock" },
+			{ 0, NULL, NULL }
+		};
+		type = g_enum_register_static("GstDVBSinkDeviceBackend", values);
+	}
+	return type;
+}
+
+static void device_fd_close(device_t *device)
+{
+	close(device->fd);
+}
+
+static int device_dvb_open(device_t *device, const char *path)
+{
+	return open(path, O_RDWR | O_NONBLOCK);
+}
+
+static int device_dvb_ioctl(device_t *device, unsigned long request, unsigned long arg)
+{
+	return ioctl(device->fd, request, arg);
+}
+
+static const struct device_ops device_dvb_ops =
+{
+	device_dvb_open,
+	device_fd_close,
+	device_dvb_ioctl
+};
+
+static int device_file_open(device_t *device, const char *path)
+{
+	/* a FIFO blocks here until there is a reader, like any other writer */
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+/* there is no decoder to control, pretend everything worked */
+static int device_file_ioctl(device_t *device, unsigned long request, unsigned long arg)
+{
+	return 0;
+}
+
+static const struct device_ops device_file_ops =
+{
+	device_file_open,
+	device_fd_close,
+	device_file_ioctl
+};
+
+/*
+ * The mock backend emulates a decoder. The sink writes into one end of a
+ * loopback TCP connection, a thread reads the PES stream from the other end
+ * into a decoder buffer of mock_buffer_size bytes, and drains it unit by unit
+ * (the data from one PTS up to the next) as a simulated STC passes the PTS.
+ * Data without a PTS drains at mock_rate bytes per second instead.
+ * TCP because it can signal both conditions the sinks poll the decoder for,
+ * independently of each other: a byte queued back to the sink end makes it
+ * readable (POLLIN, decoder buffer empty), an urgent byte gives POLLPRI
+ * (event pending).
+ */
+#define MOCK_MAX_UNITS 1024
+#define MOCK_MAX_EVENTS 8
+/* a PTS further ahead of the STC than this is a discontinuity, resync to it */
+#define MOCK_PTS_JUMP (5 * 90000)
+
+enum
+{
+	MOCK_SYNC,
+	MOCK_HEADER,
+	MOCK_PAYLOAD
+};
+
+typedef struct device_mock_unit
+{
+	guint64 pts;
+	gboolean has_pts;
+	size_t bytes;
+} device_mock_unit_t;
+
+typedef struct device_mock
+{
+	/* decoder end, sink end */
+	int sock[2];
+	int wakeupfd;
+	guint64 rate;
+	size_t buffer_size;
+	GThread *thread;
+
+	/* everything below is protected by mutex */
+	GMutex *mutex;
+	gboolean running;
+	gboolean stopping;
+	/* bumped by CLEAR_BUFFER, data read before that is dropped */
+	guint generation;
+
+	/* STC, stc_base at monotonic time stc_time, only advancing while running */
+	gboolean synced;
+	guint64 stc_base;
+	gint64 stc_time;
+	/* bytes that data without PTS may still drain, at budget_time */
+	guint64 budget;
+	gint64 budget_time;
+
+	/* the decoder buffer, the last unit is still receiving data */
+	device_mock_unit_t units[MOCK_MAX_UNITS];
+	guint head, count;
+	size_t fill;
+	/* the last unit was presented already, the rest of its data is dropped */
+	gboolean current_presented;
+
+	/* PES parser */
+	int state;
+	guint32 sync;
+	guint8 header[9 + 255];
+	guint header_len;
+	size_t payload_left;
+	gboolean video;
+	/* scanner for MPEG-2 sequence headers in video payload */
+	guint32 es_sync;
+	guint8 sequence[4];
+	int sequence_len;
+	int width, height, aspect, framerate;
+
+	struct video_event events[MOCK_MAX_EVENTS];
+	int nevents;
+	/* state currently signalled on the sink end */
+	gboolean signalled_empty, signalled_event;
+} device_mock_t;
+
+static gint64 device_mock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static guint64 device_mock_stc(device_mock_t *mock, gint64 now)
+{
+	if (!mock->synced || !mock->running) return mock->stc_base;
+	return mock->stc_base + (now - mock->stc_time) * 9 / 100;
+}
+
+static void device_mock_reset(device_mock_t *mock)
+{
+	mock->head = mock->count = 0;
+	mock->fill = 0;
+	mock->current_presented = FALSE;
+	mock->state = MOCK_SYNC;
+	mock->sync = 0xffffffff;
+	mock->payload_left = 0;
+	mock->es_sync = 0xffffffff;
+	mock->sequence_len = -1;
+	mock->synced = FALSE;
+	/* like a cleared decoder, report no PTS until the next picture */
+	mock->stc_base = 0;
+	mock->generation++;
+}
+
+/* make POLLIN and POLLPRI on the sink end reflect the decoder state */
+static void device_mock_signal(device_mock_t *mock)
+{
+	gboolean empty, event = mock->nevents > 0;
+	int pending = 0;
+	char buffer[16];
+
+	ioctl(mock->sock[0], FIONREAD, &pending);
+	empty = !pending && mock->fill == 0;
+	if (empty == mock->signalled_empty && event == mock->signalled_event) return;
+
+	/* take back what was signalled before, and start over */
+	recv(mock->sock[1], buffer, 1, MSG_OOB | MSG_DONTWAIT);
+	while (recv(mock->sock[1], buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+	if (empty) send(mock->sock[0], "e", 1, MSG_DONTWAIT);
+	if (event) send(mock->sock[0], "p", 1, MSG_OOB | MSG_DONTWAIT);
+	mock->signalled_empty = empty;
+	mock->signalled_event = event;
+}
+
+static void device_mock_push_event(device_mock_t *mock, struct video_event *event)
+{
+	if (mock->nevents == MOCK_MAX_EVENTS) return;
+	event->timestamp = time(NULL);
+	mock->events[mock->nevents++] = *event;
+}
+
+static void device_mock_sequence_header(device_mock_t *mock)
+{
+	static const int framerates[16] = { 0, 23976, 24000, 25000, 29970, 30000, 50000, 59940, 60000 };
+	struct video_event event;
+	int width = (mock->sequence[0] << 4) | (mock->sequence[1] >> 4);
+	int height = ((mock->sequence[1] & 0xf) << 8) | mock->sequence[2];
+	/* aspect_ratio_information 3 is 16:9, 4 is 2.21:1, the rest is taken as 4:3 */
+	int aspect = (mock->sequence[3] >> 4) == 3 ? VIDEO_FORMAT_16_9 : (mock->sequence[3] >> 4) == 4 ? VIDEO_FORMAT_221_1 : VIDEO_FORMAT_4_3;
+	int framerate = framerates[mock->sequence[3] & 0xf];
+
+	if (width != mock->width || height != mock->height || aspect != mock->aspect)
+	{
+		memset(&event, 0, sizeof(event));
+		event.type = VIDEO_EVENT_SIZE_CHANGED;
+		event.u.size.w = mock->width = width;
+		event.u.size.h = mock->height = height;
+		event.u.size.aspect_ratio = mock->aspect = aspect;
+		device_mock_push_event(mock, &event);
+	}
+	if (framerate && framerate != mock->framerate)
+	{
+		memset(&event, 0, sizeof(event));
+		event.type = VIDEO_EVENT_FRAME_RATE_CHANGED;
+		event.u.frame_rate = mock->framerate = framerate;
+		device_mock_push_event(mock, &event);
+	}
+}
+
+static void device_mock_scan_es(device_mock_t *mock, const guint8 *data, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+	{
+		if (mock->sequence_len >= 0)
+		{
+			mock->sequence[mock->sequence_len++] = data[i];
+			if (mock->sequence_len == sizeof(mock->sequence))
+			{
+				device_mock_sequence_header(mock);
+				mock->sequence_len = -1;
+			}
+		}
+		mock->es_sync = (mock->es_sync << 8) | data[i];
+		if (mock->es_sync == 0x000001b3) mock->sequence_len = 0;
+	}
+}
+
+/* add len bytes of received data to the last unit */
+static void device_mock_account(device_mock_t *mock, size_t len)
+{
+	if (!len || mock->current_presented) return;
+	if (!mock->count)
+	{
+		mock->units[mock->head].has_pts = FALSE;
+		mock->units[mock->head].bytes = 0;
+		mock->count = 1;
+	}
+	mock->units[(mock->head + mock->count - 1) % MOCK_MAX_UNITS].bytes += len;
+	mock->fill += len;
+}
+
+static void device_mock_new_unit(device_mock_t *mock, guint64 pts)
+{
+	device_mock_unit_t *unit;
+	/* out of units, the data goes to the last one */
+	if (mock->count == MOCK_MAX_UNITS) return;
+	unit = &mock->units[(mock->head + mock->count++) % MOCK_MAX_UNITS];
+	unit->pts = pts;
+	unit->has_pts = TRUE;
+	unit->bytes = 0;
+	mock->current_presented = FALSE;
+}
+
+static void device_mock_parse(device_mock_t *mock, const guint8 *data, size_t len)
+{
+	size_t i = 0, accounted = 0;
+
+	while (i < len)
+	{
+		guint8 b = data[i];
+		switch (mock->state)
+		{
+		case MOCK_SYNC:
+			/* also the payload of a PES without length, which ends at the next PES header */
+			if (mock->video) device_mock_scan_es(mock, &b, 1);
+			mock->sync = (mock->sync << 8) | b;
+			if ((mock->sync & 0xffffff00) == 0x00000100 && (b == 0xbd || (b >= 0xc0 && b <= 0xef)))
+			{
+				mock->header[0] = mock->header[1] = 0;
+				mock->header[2] = 1;
+				mock->header[3] = b;
+				mock->header_len = 4;
+				mock->state = MOCK_HEADER;
+			}
+			i++;
+			break;
+		case MOCK_HEADER:
+			mock->header[mock->header_len++] = b;
+			i++;
+			if (mock->header_len == 7 && (b & 0xc0) != 0x80)
+			{
+				/* not an MPEG-2 PES header */
+				mock->sync = 0xffffffff;
+				mock->state = MOCK_SYNC;
+			}
+			else if (mock->header_len >= 9 && mock->header_len == 9u + mock->header[8])
+			{
+				size_t length = (mock->header[4] << 8) | mock->header[5];
+				mock->video = mock->header[3] >= 0xe0;
+				if ((mock->header[7] & 0x80) && mock->header[8] >= 5)
+				{
+					const guint8 *p = &mock->header[9];
+					guint64 pts = ((guint64)(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] & 0xfe) << 14) | (p[3] << 7) | (p[4] >> 1);
+					device_mock_account(mock, i - accounted);
+					accounted = i;
+					device_mock_new_unit(mock, pts);
+				}
+				mock->sync = 0xffffffff;
+				if (!length)
+				{
+					mock->state = MOCK_SYNC;
+				}
+				else if (length > 3u + mock->header[8])
+				{
+					mock->payload_left = length - 3 - mock->header[8];
+					mock->state = MOCK_PAYLOAD;
+				}
+				else
+				{
+					mock->video = FALSE;
+					mock->state = MOCK_SYNC;
+				}
+			}
+			break;
+		case MOCK_PAYLOAD:
+		{
+			size_t n = MIN(mock->payload_left, len - i);
+			if (mock->video) device_mock_scan_es(mock, &data[i], n);
+			i += n;
+			mock->payload_left -= n;
+			if (!mock->payload_left)
+			{
+				mock->video = FALSE;
+				mock->state = MOCK_SYNC;
+			}
+			break;
+		}
+		}
+	}
+	device_mock_account(mock, len - accounted);
+}
+
+/* drain the decoder buffer up to the STC, returns how long to wait for the next unit, in ms */
+static int device_mock_present(device_mock_t *mock, gint64 now)
+{
+	if (mock->rate)
+	{
+		mock->budget += (now - mock->budget_time) * mock->rate / G_USEC_PER_SEC;
+		mock->budget = MIN(mock->budget, mock->buffer_size);
+	}
+	mock->budget_time = now;
+
+	while (mock->count)
+	{
+		device_mock_unit_t *unit = &mock->units[mock->head];
+		if (mock->count == 1 && mock->current_presented) break;
+		if (unit->has_pts)
+		{
+			guint64 stc = device_mock_stc(mock, now);
+			if (!mock->synced || unit->pts > stc + MOCK_PTS_JUMP)
+			{
+				mock->synced = TRUE;
+				mock->stc_base = unit->pts;
+				mock->stc_time = now;
+			}
+			else if (unit->pts > stc)
+			{
+				return MAX(1, MIN(100, (int)((unit->pts - stc) / 90)));
+			}
+		}
+		else if (mock->rate)
+		{
+			size_t n = MIN(unit->bytes, mock->budget);
+			unit->bytes -= n;
+			mock->fill -= n;
+			mock->budget -= n;
+			if (unit->bytes) return 10;
+			if (mock->count == 1) break;
+		}
+		mock->fill -= unit->bytes;
+		unit->bytes = 0;
+		if (mock->count == 1)
+		{
+			/* still receiving, drop the rest of it */
+			if (unit->has_pts) mock->current_presented = TRUE;
+			break;
+		}
+		mock->head = (mock->head + 1) % MOCK_MAX_UNITS;
+		mock->count--;
+	}
+	return 100;
+}
+
+static gpointer device_mock_thread(gpointer data)
+{
+	device_mock_t *mock = data;
+	guint8 buffer[16384];
+
+	while (1)
+	{
+		struct pollfd pfd[2];
+		size_t room;
+		guint generation;
+		int timeout = 100;
+
+		g_mutex_lock(mock->mutex);
+		if (mock->stopping)
+		{
+			g_mutex_unlock(mock->mutex);
+			break;
+		}
+		if (mock->running) timeout = device_mock_present(mock, device_mock_now());
+		room = mock->count < MOCK_MAX_UNITS ? mock->buffer_size - mock->fill : 0;
+		generation = mock->generation;
+		device_mock_signal(mock);
+		g_mutex_unlock(mock->mutex);
+
+		pfd[0].fd = mock->wakeupfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = mock->sock[0];
+		pfd[1].events = room ? POLLIN : 0;
+		if (poll(pfd, 2, timeout) <= 0) continue;
+		if (pfd[0].revents & POLLIN)
+		{
+			guint64 value;
+			read(mock->wakeupfd, &value, sizeof(value));
+		}
+		if (pfd[1].revents & POLLIN)
+		{
+			ssize_t rd = read(mock->sock[0], buffer, MIN(room, sizeof(buffer)));
+			if (rd <= 0) continue;
+			g_mutex_lock(mock->mutex);
+			if (generation == mock->generation) device_mock_parse(mock, buffer, rd);
+			g_mutex_unlock(mock->mutex);
+		}
+	}
+	return NULL;
+}
+
+static void device_mock_wakeup(device_mock_t *mock)
+{
+	guint64 one = 1;
+	write(mock->wakeupfd, &one, sizeof(one));
+}
+
+static void device_mock_set_running(device_mock_t *mock, gboolean running)
+{
+	gint64 now = device_mock_now();
+	g_mutex_lock(mock->mutex);
+	if (running != mock->running)
+	{
+		/* freeze or restart the STC where it is */
+		mock->stc_base = device_mock_stc(mock, now);
+		mock->stc_time = now;
+		mock->budget_time = now;
+		mock->running = running;
+	}
+	g_mutex_unlock(mock->mutex);
+	device_mock_wakeup(mock);
+}
+
+/* a connected loopback TCP pair, sv[0] is accepted, sv[1] connected */
+static int device_mock_socketpair(int sv[2])
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int listener, one = 1, size = 64 * 1024;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener < 0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sv[0] = sv[1] = -1;
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+		getsockname(listener, (struct sockaddr*)&addr, &addrlen) < 0) goto error;
+	sv[1] = socket(AF_INET, SOCK_STREAM, 0);
+	if (sv[1] < 0) goto error;
+	/* keep the data in flight small, so the decoder buffer is what applies backpressure */
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	if (connect(sv[1], (struct sockaddr*)&addr, sizeof(addr)) < 0) goto error;
+	sv[0] = accept(listener, NULL, NULL);
+	if (sv[0] < 0) goto error;
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	/* the signalling bytes must not wait for an ack */
+	setsockopt(sv[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	close(listener);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	return 0;
+error:
+	if (sv[1] >= 0) close(sv[1]);
+	close(listener);
+	return -1;
+}
+
+static int device_mock_open(device_t *device, const char *path)
+{
+	device_mock_t *mock = g_new0(device_mock_t, 1);
+
+	if (device_mock_socketpair(mock->sock) < 0)
+	{
+		g_free(mock);
+		return -1;
+	}
+	mock->wakeupfd = eventfd(0, EFD_NONBLOCK);
+	if (mock->wakeupfd < 0) goto error;
+	mock->rate = device->mock_rate;
+	mock->buffer_size = device->mock_buffer_size ? device->mock_buffer_size : DEVICE_MOCK_BUFFER_SIZE;
+	mock->width = mock->height = mock->aspect = -1;
+	mock->budget_time = device_mock_now();
+	device_mock_reset(mock);
+	mock->mutex = g_mutex_new();
+	mock->thread = g_thread_create(device_mock_thread, mock, TRUE, NULL);
+	if (!mock->thread)
+	{
+		g_mutex_free(mock->mutex);
+		goto error;
+	}
+	device->mock = mock;
+	return mock->sock[1];
+error:
+	if (mock->wakeupfd >= 0) close(mock->wakeupfd);
+	close(mock->sock[0]);
+	close(mock->sock[1]);
+	g_free(mock);
+	return -1;
+}
+
+static void device_mock_close(device_t *device)
+{
+	device_mock_t *mock = device->mock;
+
+	g_mutex_lock(mock->mutex);
+	mock->stopping = TRUE;
+	g_mutex_unlock(mock->mutex);
+	device_mock_wakeup(mock);
+	g_thread_join(mock->thread);
+
+	close(mock->sock[1]);
+	close(mock->sock[0]);
+	close(mock->wakeupfd);
+	g_mutex_free(mock->mutex);
+	g_free(mock);
+	device->mock = NULL;
+}
+
+static int device_mock_ioctl(device_t *device, unsigned long request, unsigned long arg)
+{
+	device_mock_t *mock = device->mock;
+	int ret = 0;
+
+	switch (request)
+	{
+	case AUDIO_PLAY:
+	case AUDIO_CONTINUE:
+	case VIDEO_PLAY:
+	case VIDEO_CONTINUE:
+		device_mock_set_running(mock, TRUE);
+		break;
+	case AUDIO_STOP:
+	case VIDEO_STOP:
+		device_mock_set_running(mock, FALSE);
+		g_mutex_lock(mock->mutex);
+		mock->synced = FALSE;
+		g_mutex_unlock(mock->mutex);
+		break;
+	case AUDIO_PAUSE:
+	case VIDEO_FREEZE:
+		device_mock_set_running(mock, FALSE);
+		break;
+	case AUDIO_CLEAR_BUFFER:
+	case VIDEO_CLEAR_BUFFER:
+	{
+		guint8 buffer[4096];
+		g_mutex_lock(mock->mutex);
+		while (read(mock->sock[0], buffer, sizeof(buffer)) > 0);
+		device_mock_reset(mock);
+		g_mutex_unlock(mock->mutex);
+		device_mock_wakeup(mock);
+		break;
+	}
+	case AUDIO_GET_PTS:
+	case VIDEO_GET_PTS:
+		g_mutex_lock(mock->mutex);
+		*(guint64*)(gsize)arg = device_mock_stc(mock, device_mock_now()) & 0x1ffffffffULL;
+		g_mutex_unlock(mock->mutex);
+		break;
+	case VIDEO_GET_EVENT:
+		g_mutex_lock(mock->mutex);
+		if (!mock->nevents)
+		{
+			errno = EWOULDBLOCK;
+			ret = -1;
+		}
+		else
+		{
+			*(struct video_event*)(gsize)arg = mock->events[0];
+			memmove(&mock->events[0], &mock->events[1], --mock->nevents * sizeof(mock->events[0]));
+			device_mock_signal(mock);
+		}
+		g_mutex_unlock(mock->mutex);
+		break;
+	default:
+		break;
+	}
+	return ret;
+}
+
+static const struct device_ops device_mock_ops =
+{
+	device_mock_open,
+	device_mock_close,
+	device_mock_ioctl
+};
+
+void device_init(device_t *device)
+{
+	device->ops = NULL;
+	device->fd = -1;
+	device->mock_rate = 0;
+	device->mock_buffer_size = DEVICE_MOCK_BUFFER_SIZE;
+	device->mock = NULL;
+	device->backend = DEVICE_BACKEND_DVB;
+	device->path = NULL;
+	device->stream_type = -1;
+	device->adopted = FALSE;
+	device->capture = NULL;
+}
+
+/* devices kept open by device_park */
+typedef struct device_parked
+{
+	device_t device;
+	/* handing the decoder back to whoever else uses it, before it is closed */
+	unsigned long release_request, release_arg;
+	/* CLOCK_MONOTONIC ms after which the reaper closes it, 0 for never */
+	guint64 expires;
+	struct device_parked *next;
+} device_parked_t;
+
+static device_parked_t *parked;
+G_LOCK_DEFINE_STATIC(parked);
+/* the reaper closes expired devices, it runs while there are any that expire */
+static GThread *parked_reaper;
+static int parked_wakeupfd = -1;
+static gboolean parked_atexit;
+
+static guint64 device_parked_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* close the parked devices in the list, back in the hands of the demux */
+static void device_parked_close(device_parked_t *list)
+{
+	while (list)
+	{
+		device_parked_t *p = list;
+		list = p->next;
+		device_ioctl(&p->device, p->release_request, p->release_arg);
+		device_close(&p->device);
+		g_free(p);
+	}
+}
+
+static gpointer device_parked_reaper(gpointer data)
+{
+	G_LOCK(parked);
+	while (1)
+	{
+		device_parked_t **p = &parked, *expired = NULL;
+		guint64 now = device_parked_now(), next = 0;
+		struct pollfd pfd;
+		guint64 count;
+
+		while (*p)
+		{
+			device_parked_t *entry = *p;
+			if (entry->expires && entry->expires <= now)
+			{
+				*p = entry->next;
+				entry->next = expired;
+				expired = entry;
+				continue;
+			}
+			if (entry->expires && (!next || entry->expires < next)) next = entry->expires;
+			p = &entry->next;
+		}
+		if (!next && !expired)
+		{
+			parked_reaper = NULL;
+			break;
+		}
+		G_UNLOCK(parked);
+		device_parked_close(expired);
+		/* a park or release wakes us up to look at the list again */
+		pfd.fd = parked_wakeupfd;
+		pfd.events = POLLIN;
+		if (next && poll(&pfd, 1, MIN(next - now, G_MAXINT)) > 0) read(parked_wakeupfd, &count, sizeof(count));
+		G_LOCK(parked);
+	}
+	G_UNLOCK(parked);
+	return NULL;
+}
+
+/* called with the parked lock */
+static void device_parked_wakeup_reaper(void)
+{
+	guint64 one = 1;
+	if (parked_wakeupfd < 0) parked_wakeupfd = eventfd(0, EFD_NONBLOCK);
+	if (parked_reaper)
+	{
+		write(parked_wakeupfd, &one, sizeof(one));
+	}
+	else if (parked_wakeupfd >= 0)
+	{
+		parked_reaper = g_thread_create(device_parked_reaper, NULL, FALSE, NULL);
+	}
+}
+
+/* close all parked devices, a parked decoder is never left open on exit either */
+void device_release_parked(void)
+{
+	device_parked_t *list;
+
+	G_LOCK(parked);
+	list = parked;
+	parked = NULL;
+	G_UNLOCK(parked);
+	device_parked_close(list);
+}
+
+static void device_release_parked_atexit(void)
+{
+	device_release_parked();
+}
+
+static gboolean device_parked_matches(const device_t *parked, const device_t *device, device_backend_t backend, const char *path)
+{
+	return parked->backend == backend && !g_strcmp0(parked->path, path) &&
+		(backend != DEVICE_BACKEND_MOCK || (parked->mock_rate == device->mock_rate && parked->mock_buffer_size == device->mock_buffer_size));
+}
+
+/* take the parked device matching the arguments out of the list, NULL if there is none */
+static device_parked_t *device_unpark(const device_t *device, device_backend_t backend, const char *path)
+{
+	device_parked_t **p, *found = NULL;
+
+	G_LOCK(parked);
+	for (p = &parked; *p; p = &(*p)->next)
+	{
+		if (device_parked_matches(&(*p)->device, device, backend, path))
+		{
+			found = *p;
+			*p = found->next;
+			break;
+		}
+	}
+	G_UNLOCK(parked);
+	return found;
+}
+
+int device_open(device_t *device, device_backend_t backend, const char *path)
+{
+	device_parked_t *found = device_unpark(device, backend, path);
+
+	if (found)
+	{
+		struct capture *capture = device->capture;
+		*device = found->device;
+		device->capture = capture;
+		device->adopted = TRUE;
+		g_free(found);
+		return device->fd;
+	}
+
+	switch (backend)
+	{
+	case DEVICE_BACKEND_FILE:
+		device->ops = &device_file_ops;
+		break;
+	case DEVICE_BACKEND_MOCK:
+		device->ops = &device_mock_ops;
+		break;
+	case DEVICE_BACKEND_DVB:
+	default:
+		device->ops = &device_dvb_ops;
+		break;
+	}
+	device->fd = path || backend == DEVICE_BACKEND_MOCK ? device->ops->open(device, path) : -1;
+	if (device->fd >= 0)
+	{
+		device->backend = backend;
+		device->path = g_strdup(path);
+		device->stream_type = -1;
+		device->adopted = FALSE;
+	}
+	return device->fd;
+}
+
+gchar *device_dvb_path(const char *type, guint adapter, guint index)
+{
+	return g_strdup_printf("/dev/dvb/adapter%u/%s%u", adapter, type, index);
+}
+
+void device_close(device_t *device)
+{
+	if (device->fd < 0) return;
+	device->ops->close(device);
+	device->fd = -1;
+	g_free(device->path);
+	device->path = NULL;
+}
+
+void device_park(device_t *device, guint timeout, unsigned long release_request, unsigned long release_arg)
+{
+	device_parked_t *p, *replaced;
+
+	if (device->fd < 0) return;
+	/* there is only room for one per device, the older one goes */
+	replaced = device_unpark(device, device->backend, device->path);
+	if (replaced)
+	{
+		replaced->next = NULL;
+		device_parked_close(replaced);
+	}
+
+	p = g_new0(device_parked_t, 1);
+	p->device = *device;
+	p->device.capture = NULL;
+	p->release_request = release_request;
+	p->release_arg = release_arg;
+	if (timeout) p->expires = device_parked_now() + (guint64)timeout * 1000;
+	G_LOCK(parked);
+	p->next = parked;
+	parked = p;
+	if (timeout) device_parked_wakeup_reaper();
+	if (!parked_atexit) parked_atexit = !atexit(device_release_parked_atexit);
+	G_UNLOCK(parked);
+
+	device->fd = -1;
+	device->mock = NULL;
+	device->path = NULL;
+}
+
+/* ioctl(2) on whatever backend the device has open, with arg 0 for the
+ * requests without an argument, and pointers cast to unsigned long */
+int device_ioctl(device_t *device, unsigned long request, unsigned long arg)
+{
+	int ret;
+
+	if (device->fd < 0)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if (device->capture) capture_ioctl(device->capture, request, arg);
+	ret = device->ops->ioctl(device, request, arg);
+	if (ret >= 0 && (request == VIDEO_SET_STREAMTYPE || request == AUDIO_SET_BYPASS_MODE))
+	{
+		device->stream_type = arg;
+	}
+	return ret;
+}
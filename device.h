@@ -0,0 +1,70 @@
+#ifndef _device_h
+#define _device_h
+
+#include <linux/dvb/video.h>
+
+/* ioctls of the STB drivers missing from the kernel headers */
+#ifndef VIDEO_SET_CODEC_DATA
+typedef struct video_codec_data
+{
+	int length;
+	guint8 *data;
+} video_codec_data_t;
+#define VIDEO_SET_CODEC_DATA _IOW('o', 80, video_codec_data_t)
+#endif
+
+/* where the data of a sink goes */
+typedef enum
+{
+	DEVICE_BACKEND_DVB,
+	/* a regular file or FIFO, ioctls are ignored */
+	DEVICE_BACKEND_FILE,
+	/* an in-process decoder emulator, draining the PES stream by its PTS */
+	DEVICE_BACKEND_MOCK
+} device_backend_t;
+
+#define DEVICE_TYPE_BACKEND (device_backend_get_type())
+GType device_backend_get_type(void);
+
+#define DEVICE_MOCK_BUFFER_SIZE (1024 * 1024)
+
+struct device_mock;
+struct capture;
+
+typedef struct device
+{
+	const struct device_ops *ops;
+	/* what gets written to and polled, -1 while closed */
+	int fd;
+	/* what device_open was called with */
+	device_backend_t backend;
+	gchar *path;
+	/* the last VIDEO_SET_STREAMTYPE or AUDIO_SET_BYPASS_MODE that was set,
+	 * -1 if none, kept while the device is parked */
+	int stream_type;
+	/* device_open took over a parked device instead of opening it */
+	gboolean adopted;
+	/* bytes per second the mock backend drains data without PTS at, 0 for as fast as possible */
+	guint64 mock_rate;
+	/* size of the decoder buffer the mock backend emulates */
+	guint mock_buffer_size;
+	struct device_mock *mock;
+	/* records the ioctls made on the device when set, see capture.h */
+	struct capture *capture;
+} device_t;
+
+void device_init(device_t *device);
+/* open path (unused by the mock backend) with the given backend, returns the fd or -1 */
+int device_open(device_t *device, device_backend_t backend, const char *path);
+/* /dev/dvb/adapter<adapter>/<type><index>, free with g_free */
+gchar *device_dvb_path(const char *type, guint adapter, guint index);
+void device_close(device_t *device);
+/* close the device as far as the caller is concerned, but keep it open for
+ * the next device_open with the same backend, path and mock settings.
+ * It is closed after timeout seconds (0 = never) without being taken over,
+ * on device_release_parked or at exit, always with the release ioctl first */
+void device_park(device_t *device, guint timeout, unsigned long release_request, unsigned long release_arg);
+void device_release_parked(void);
+int device_ioctl(device_t *device, unsigned long request, unsigned long arg);
+
+#endif
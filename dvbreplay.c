@@ -0,0 +1,248 @@
+/*
+ * Replays a capture made with the capture property of the dvb sinks
+ *
+ * Feeds the recorded data to a device in the recorded order, with the
+ * recorded ioctls in between, either at the original pace (every record is
+ * issued at its time in the index) or as fast as the device takes it (-x).
+ * Prints one line of key=value pairs at the end: how long writes blocked on
+ * the device, and how far behind the original timing records were issued,
+ * which is where a stall shows up.
+ *
+ * usage: dvbreplay [-b dvb|file|mock] [-x] [-r rate] [-s size] capture [device]
+ *   -b  backend to open the device with, dvb by default
+ *   -x  replay as fast as the device takes the data
+ *   -r  mock-rate of the mock backend, in bytes per second
+ *   -s  mock-buffer-size of the mock backend, in bytes
+ * The device is needed for the dvb and file backends, the index is read
+ * from the capture file name with .idx appended.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <gst/gst.h>
+
+#include "device.h"
+#include "capture.h"
+
+static guint64 now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+static void sleep_until(guint64 time)
+{
+	struct timespec ts;
+	ts.tv_sec = time / GST_SECOND;
+	ts.tv_nsec = time % GST_SECOND;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* write all of data to the non-blocking device fd, returns the ns spent waiting for it, or -1 */
+static gint64 write_all(int fd, const guint8 *data, size_t len)
+{
+	gint64 blocked = 0;
+	while (len)
+	{
+		ssize_t wr = write(fd, data, len);
+		if (wr < 0)
+		{
+			struct pollfd pfd;
+			guint64 start;
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) return -1;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			start = now();
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+			blocked += now() - start;
+			continue;
+		}
+		data += wr;
+		len -= wr;
+	}
+	return blocked;
+}
+
+static int hex_decode(const char *hex, guint8 *data, int len)
+{
+	int i;
+	for (i = 0; i < len; i++)
+	{
+		unsigned int byte;
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1) return -1;
+		data[i] = byte;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	device_t device;
+	device_backend_t backend = DEVICE_BACKEND_DVB;
+	gboolean fast = FALSE;
+	const char *path, *device_path = NULL;
+	gchar *index_path;
+	FILE *data, *index;
+	char *line = NULL;
+	size_t line_size = 0;
+	guint8 *buffer = NULL;
+	size_t buffer_size = 0;
+	guint64 offset = 0, bytes = 0, start, end;
+	guint64 blocked = 0, max_blocked = 0, max_late = 0, max_late_at = 0;
+	unsigned int writes = 0, ioctls = 0;
+	int opt;
+
+	gst_init(&argc, &argv);
+	device_init(&device);
+
+	while ((opt = getopt(argc, argv, "b:xr:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+		{
+			GEnumValue *value = g_enum_get_value_by_nick(g_type_class_ref(DEVICE_TYPE_BACKEND), optarg);
+			if (!value)
+			{
+				fprintf(stderr, "unknown backend %s\n", optarg);
+				return 1;
+			}
+			backend = value->value;
+			break;
+		}
+		case 'x':
+			fast = TRUE;
+			break;
+		case 'r':
+			device.mock_rate = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			device.mock_buffer_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc) goto usage;
+	path = argv[optind];
+	if (optind + 1 < argc) device_path = argv[optind + 1];
+	if (!device_path && backend != DEVICE_BACKEND_MOCK) goto usage;
+
+	index_path = g_strconcat(path, CAPTURE_INDEX_SUFFIX, NULL);
+	data = fopen(path, "rb");
+	index = fopen(index_path, "r");
+	if (!data || !index)
+	{
+		perror(data ? index_path : path);
+		return 1;
+	}
+	g_free(index_path);
+
+	if (device_open(&device, backend, device_path) < 0)
+	{
+		perror(device_path ? device_path : "mock device");
+		return 1;
+	}
+
+	start = now();
+	while (getline(&line, &line_size, index) > 0)
+	{
+		guint64 time;
+		char type[16];
+		int pos;
+
+		if (line[0] == '#' || line[0] == '\n') continue;
+		if (sscanf(line, "%" G_GUINT64_FORMAT " %15s %n", &time, type, &pos) < 2)
+		{
+			fprintf(stderr, "bad index line: %s", line);
+			return 1;
+		}
+		if (!fast)
+		{
+			guint64 current = now();
+			if (current < start + time) sleep_until(start + time);
+			else if (current - start - time > max_late)
+			{
+				max_late = current - start - time;
+				max_late_at = time;
+			}
+		}
+
+		if (!strcmp(type, "write"))
+		{
+			guint64 record_offset;
+			unsigned int size;
+			gint64 waited;
+			if (sscanf(line + pos, "%" G_GUINT64_FORMAT " %u", &record_offset, &size) != 2) goto bad;
+			if (size > buffer_size)
+			{
+				buffer_size = size;
+				buffer = g_realloc(buffer, buffer_size);
+			}
+			if (record_offset != offset && fseeko(data, record_offset, SEEK_SET) < 0) goto bad;
+			if (fread(buffer, 1, size, data) != size) goto bad;
+			offset = record_offset + size;
+			waited = write_all(device.fd, buffer, size);
+			if (waited < 0)
+			{
+				perror("write");
+				return 1;
+			}
+			blocked += waited;
+			if ((guint64)waited > max_blocked) max_blocked = waited;
+			bytes += size;
+			writes++;
+		}
+		else if (!strcmp(type, "ioctl"))
+		{
+			unsigned long request, arg;
+			int hex = 0;
+			if (sscanf(line + pos, "%lx %lu %n", &request, &arg, &hex) < 2) goto bad;
+			if (request == VIDEO_SET_CODEC_DATA)
+			{
+				video_codec_data_t codec_data;
+				codec_data.length = arg;
+				codec_data.data = g_malloc(arg);
+				if (hex_decode(line + pos + hex, codec_data.data, arg) < 0) goto bad;
+				device_ioctl(&device, request, (unsigned long)&codec_data);
+				g_free(codec_data.data);
+			}
+			else
+			{
+				device_ioctl(&device, request, arg);
+			}
+			ioctls++;
+		}
+		continue;
+bad:
+		fprintf(stderr, "bad index line, or data missing from the capture: %s", line);
+		return 1;
+	}
+	end = now();
+
+	printf("writes=%u ioctls=%u bytes=%" G_GUINT64_FORMAT " elapsed=%.3f mbit_per_s=%.2f blocked_ms=%.1f max_blocked_ms=%.1f max_late_ms=%.1f max_late_at=%.3f\n",
+		writes, ioctls, bytes, (end - start) / 1e9, bytes * 8 / 1e6 / ((end - start) / 1e9),
+		blocked / 1e6, max_blocked / 1e6, max_late / 1e6, max_late_at / 1e9);
+
+	device_close(&device);
+	fclose(index);
+	fclose(data);
+	g_free(buffer);
+	free(line);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-b dvb|file|mock] [-x] [-r rate] [-s size] capture [device]\n", argv[0]);
+	return 1;
+}
@@ -10,6 +10,7 @@
 #include <gst/gst.h>
 
 #include "gstdtsdownmix.h"
+#include "parse.h"
 
 GST_DEBUG_CATEGORY_STATIC(dtsdownmix_debug);
 #define GST_CAT_DEFAULT (dtsdownmix_debug)
@@ -334,12 +335,10 @@ static GstFlowReturn gst_dtsdownmix_chain(GstPad *pad, GstBuffer *buf)
 	{
 		if (dts->dtsheader[0])
 		{
-			if (memcmp(dts->dtsheader, data, 4))
-			{
-				data++;
-				size--;
-				continue;
-			}
+			size_t skip = dts_find_sync(data, size, dts->dtsheader);
+			data += skip;
+			size -= skip;
+			if (size < 7) break;
 		}
 		else
 		{
@@ -519,18 +518,3 @@ static GstStateChangeReturn gst_dtsdownmix_change_state(GstElement * element, Gs
 
 	return ret;
 }
-
-static gboolean plugin_init (GstPlugin * plugin)
-{
-	if (!gst_element_register (plugin, "dtsdownmix", GST_RANK_PRIMARY,
-					GST_TYPE_DTSDOWNMIX))
-		return FALSE;
-
-	return TRUE;
-}
-
-GST_PLUGIN_DEFINE (GST_VERSION_MAJOR,
-		GST_VERSION_MINOR,
-		"dtsdownmix",
-		"Downmixes DTS audio streams",
-		plugin_init, VERSION, "LGPL", "GStreamer", "http://gstreamer.net/");
@@ -55,6 +55,8 @@ struct _GstDtsDownmixClass
 	GstElementClass parent_class;
 };
 
+GType gst_dtsdownmix_get_type(void);
+
 G_END_DECLS
 
 #endif /* __GST_DTSDOWNMIX_H__ */
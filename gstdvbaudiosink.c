@@ -64,6 +64,7 @@
 #include <config.h>
 #endif
 #include <unistd.h>
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -78,6 +79,9 @@
 #include <gst/base/gstbasesink.h>
 
 #include "common.h"
+#include "device.h"
+#include "parse.h"
+#include "capture.h"
 #include "gstdvbaudiosink.h"
 #include "gstdvbsink-marshal.h"
 
@@ -87,11 +91,53 @@ GST_DEBUG_CATEGORY_STATIC(dvbaudiosink_debug);
 enum
 {
 	SIGNAL_GET_DECODER_TIME,
+	SIGNAL_RELEASE_PARKED,
+	SIGNAL_REFRESH_CAPS,
 	LAST_SIGNAL
 };
 
 static guint gst_dvbaudiosink_signals[LAST_SIGNAL] = { 0 };
 
+enum
+{
+	PROP_0,
+	PROP_MAX_QUEUE_BYTES,
+	PROP_LOW_WATERMARK,
+	PROP_QUEUE_BYTES,
+	PROP_WRITER_THREAD,
+	PROP_SHARED_WRITER,
+	PROP_RING_DEPTH,
+	PROP_IO_URING,
+	PROP_SPLICE,
+	PROP_BYTES_WRITTEN,
+	PROP_BYTES_SPLICED,
+	PROP_SYSCALLS,
+	PROP_BACKEND,
+	PROP_ADAPTER,
+	PROP_DECODER_INDEX,
+	PROP_DEVICE,
+	PROP_MOCK_RATE,
+	PROP_MOCK_BUFFER_SIZE,
+	PROP_CAPTURE,
+	PROP_KEEP_ALIVE,
+	PROP_KEEP_ALIVE_TIMEOUT
+};
+
+#define DEFAULT_MAX_QUEUE_BYTES (1024 * 1024)
+#define DEFAULT_LOW_WATERMARK (256 * 1024)
+#define DEFAULT_WRITER_THREAD FALSE
+#define DEFAULT_SHARED_WRITER FALSE
+#define DEFAULT_IO_URING FALSE
+#define DEFAULT_SPLICE FALSE
+#define DEFAULT_BACKEND DEVICE_BACKEND_DVB
+#define DEFAULT_ADAPTER 0
+#define DEFAULT_DECODER_INDEX 0
+#define DEFAULT_KEEP_ALIVE FALSE
+#define DEFAULT_KEEP_ALIVE_TIMEOUT 5
+#define DEFAULT_MOCK_RATE 0
+#define DEFAULT_MOCK_BUFFER_SIZE (256 * 1024)
+#define DEFAULT_RING_DEPTH 64
+
 #ifdef HAVE_MP3
 #define MPEGCAPS \
 		"audio/mpeg, " \
@@ -204,6 +250,11 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink * sink, GstCaps * caps);
 static GstCaps *gst_dvbaudiosink_get_caps(GstBaseSink * sink);
 static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement * element, GstStateChange transition);
 static gint64 gst_dvbaudiosink_get_decoder_time(GstDVBAudioSink *self);
+static void gst_dvbaudiosink_release_parked(GstDVBAudioSink *self);
+static void gst_dvbaudiosink_refresh_caps(GstDVBAudioSink *self);
+static void gst_dvbaudiosink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_dvbaudiosink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
+static void gst_dvbaudiosink_finalize(GObject *object);
 
 static void gst_dvbaudiosink_base_init(gpointer self)
 {
@@ -220,6 +271,21 @@ static void gst_dvbaudiosink_base_init(gpointer self)
 	gst_element_class_set_details(element_class, &element_details);
 }
 
+#ifdef HAVE_DTSDOWNMIX
+static gboolean get_downmix_setting()
+{
+	FILE *f;
+	char buffer[32] = {0};
+	f = fopen("/proc/stb/audio/ac3", "r");
+	if (f)
+	{
+		fread(buffer, sizeof(buffer), 1, f);
+		fclose(f);
+	}
+	return !strncmp(buffer, "downmix", 7);
+}
+#endif
+
 /* initialize the plugin's class */
 static void gst_dvbaudiosink_class_init(GstDVBAudioSinkClass *self)
 {
@@ -238,6 +304,91 @@ static void gst_dvbaudiosink_class_init(GstDVBAudioSinkClass *self)
 
 	gelement_class->change_state = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_change_state);
 
+	gobject_class->set_property = gst_dvbaudiosink_set_property;
+	gobject_class->get_property = gst_dvbaudiosink_get_property;
+	gobject_class->finalize = gst_dvbaudiosink_finalize;
+
+	g_object_class_install_property(gobject_class, PROP_MAX_QUEUE_BYTES,
+		g_param_spec_uint("max-queue-bytes", "Max queue bytes",
+			"Block rendering when this many bytes are queued while paused (0 = unlimited)",
+			0, G_MAXUINT, DEFAULT_MAX_QUEUE_BYTES, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_LOW_WATERMARK,
+		g_param_spec_uint("low-watermark", "Low watermark",
+			"Resume queueing when a full queue has drained to this many bytes",
+			0, G_MAXUINT, DEFAULT_LOW_WATERMARK, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_QUEUE_BYTES,
+		g_param_spec_uint("queue-bytes", "Queue bytes",
+			"Number of bytes currently queued",
+			0, G_MAXUINT, 0, G_PARAM_READABLE));
+	g_object_class_install_property(gobject_class, PROP_WRITER_THREAD,
+		g_param_spec_boolean("writer-thread", "Writer thread",
+			"Write to the device from a dedicated thread, so rendering doesn't block on the decoder (takes effect on start)",
+			DEFAULT_WRITER_THREAD, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_SHARED_WRITER,
+		g_param_spec_boolean("shared-writer", "Shared writer",
+			"Write to the device from one epoll thread shared by all dvb sinks, instead of a writer thread per sink (takes effect on start)",
+			DEFAULT_SHARED_WRITER, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_RING_DEPTH,
+		g_param_spec_uint("ring-depth", "Ring depth",
+			"Number of buffer references between render and the (shared) writer thread (takes effect on start)",
+			2, 65536, DEFAULT_RING_DEPTH, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_IO_URING,
+		g_param_spec_boolean("io-uring", "io_uring",
+			"Write to the device through io_uring when the kernel supports it, instead of poll and writev (takes effect on start)",
+			DEFAULT_IO_URING, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_SPLICE,
+		g_param_spec_boolean("splice", "Splice",
+			"Move large writes to the device with vmsplice and splice instead of copying them, falls back to write when the device doesn't support it (takes effect on start)",
+			DEFAULT_SPLICE, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_BYTES_WRITTEN,
+		g_param_spec_uint64("bytes-written", "Bytes written",
+			"Number of bytes copied to the device with write since start",
+			0, G_MAXUINT64, 0, G_PARAM_READABLE));
+	g_object_class_install_property(gobject_class, PROP_BYTES_SPLICED,
+		g_param_spec_uint64("bytes-spliced", "Bytes spliced",
+			"Number of bytes moved to the device with splice since start",
+			0, G_MAXUINT64, 0, G_PARAM_READABLE));
+	g_object_class_install_property(gobject_class, PROP_SYSCALLS,
+		g_param_spec_uint64("syscalls", "System calls",
+			"Number of writes, polls, splices and io_uring submissions on the device since start",
+			0, G_MAXUINT64, 0, G_PARAM_READABLE));
+	g_object_class_install_property(gobject_class, PROP_BACKEND,
+		g_param_spec_enum("backend", "Backend",
+			"Where the data goes: the dvb decoder, a file or FIFO, or an in-process mock decoder (takes effect on start)",
+			DEVICE_TYPE_BACKEND, DEFAULT_BACKEND, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_ADAPTER,
+		g_param_spec_uint("adapter", "Adapter",
+			"DVB adapter of the decoder (takes effect on start)",
+			0, G_MAXUINT, DEFAULT_ADAPTER, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_DECODER_INDEX,
+		g_param_spec_uint("decoder-index", "Decoder index",
+			"Which of the decoders of the adapter to use, on boxes with more than one (takes effect on start)",
+			0, G_MAXUINT, DEFAULT_DECODER_INDEX, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_DEVICE,
+		g_param_spec_string("device", "Device",
+			"Decoder device for the dvb backend, or the file or FIFO to write for the file backend (NULL = /dev/dvb/adapter<adapter>/audio<decoder-index>, takes effect on start)",
+			NULL, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_MOCK_RATE,
+		g_param_spec_uint64("mock-rate", "Mock rate",
+			"Bytes per second the mock backend drains data without PTS at while playing (0 = as fast as possible, takes effect on start)",
+			0, G_MAXUINT64, DEFAULT_MOCK_RATE, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_MOCK_BUFFER_SIZE,
+		g_param_spec_uint("mock-buffer-size", "Mock buffer size",
+			"Size of the decoder buffer the mock backend emulates, in bytes (takes effect on start)",
+			4096, G_MAXUINT, DEFAULT_MOCK_BUFFER_SIZE, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_CAPTURE,
+		g_param_spec_string("capture", "Capture",
+			"File to record everything fed to the decoder to, with an index in <file>.idx for dvbreplay (NULL = off, takes effect on start)",
+			NULL, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_KEEP_ALIVE,
+		g_param_spec_boolean("keep-alive", "Keep alive",
+			"Leave the decoder open in memory source mode on stop, for the next sink on the same decoder to take over, which saves reopening and setting it up when zapping",
+			DEFAULT_KEEP_ALIVE, G_PARAM_READWRITE));
+	g_object_class_install_property(gobject_class, PROP_KEEP_ALIVE_TIMEOUT,
+		g_param_spec_uint("keep-alive-timeout", "Keep alive timeout",
+			"Seconds a decoder left open by keep-alive waits to be taken over, before it is switched back to the demux and closed (0 = until release-parked or exit)",
+			0, G_MAXUINT, DEFAULT_KEEP_ALIVE_TIMEOUT, G_PARAM_READWRITE));
+
 	gst_dvbaudiosink_signals[SIGNAL_GET_DECODER_TIME] =
 		g_signal_new("get-decoder-time",
 		G_TYPE_FROM_CLASS(self),
@@ -245,7 +396,51 @@ static void gst_dvbaudiosink_class_init(GstDVBAudioSinkClass *self)
 		G_STRUCT_OFFSET(GstDVBAudioSinkClass, get_decoder_time),
 		NULL, NULL, gst_dvbsink_marshal_INT64__VOID, G_TYPE_INT64, 0);
 
+	gst_dvbaudiosink_signals[SIGNAL_RELEASE_PARKED] =
+		g_signal_new("release-parked",
+		G_TYPE_FROM_CLASS(self),
+		G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+		G_STRUCT_OFFSET(GstDVBAudioSinkClass, release_parked),
+		NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+
+	gst_dvbaudiosink_signals[SIGNAL_REFRESH_CAPS] =
+		g_signal_new("refresh-caps",
+		G_TYPE_FROM_CLASS(self),
+		G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+		G_STRUCT_OFFSET(GstDVBAudioSinkClass, refresh_caps),
+		NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+
 	self->get_decoder_time = gst_dvbaudiosink_get_decoder_time;
+	self->release_parked = gst_dvbaudiosink_release_parked;
+	self->refresh_caps = gst_dvbaudiosink_refresh_caps;
+
+	/* get_caps is called many times while negotiating, it shouldn't parse caps strings every time */
+	self->caps = gst_caps_from_string(
+		MPEGCAPS 
+		AC3CAPS
+#ifdef HAVE_EAC3
+		EAC3CAPS
+#endif
+#ifdef HAVE_LPCM
+		LPCMCAPS
+#endif
+#ifdef HAVE_WMA
+		WMACAPS
+#endif
+#ifdef HAVE_AMR
+		AMRCAPS
+#endif
+#ifdef HAVE_PCM
+		PCMCAPS
+#endif
+	);
+	self->caps_without_dts = gst_caps_copy(self->caps);
+#ifdef HAVE_DTS
+	gst_caps_append(self->caps, gst_caps_from_string(DTSCAPS));
+#endif
+#ifdef HAVE_DTSDOWNMIX
+	self->downmix = get_downmix_setting();
+#endif
 }
 
 /* initialize the new element
@@ -263,13 +458,27 @@ static void gst_dvbaudiosink_init(GstDVBAudioSink *self, GstDVBAudioSinkClass *g
 	self->aac_adts_header_valid = FALSE;
 	self->pesheader_buffer = NULL;
 	self->cache = NULL;
-	self->playing = self->flushing = self->unlocking = self->paused = FALSE;
+	self->playing = FALSE;
 	self->pts_written = FALSE;
 	self->lastpts = 0;
 	self->timestamp_offset = 0;
-	self->queue = NULL;
-	self->fd = -1;
-	self->unlockfd[0] = self->unlockfd[1] = -1;
+	write_engine_init(&self->engine, GST_ELEMENT(self), NULL);
+	queue_set_watermarks(&self->engine.queue, DEFAULT_MAX_QUEUE_BYTES, DEFAULT_LOW_WATERMARK);
+	self->engine.threaded = DEFAULT_WRITER_THREAD;
+	self->engine.shared_writer = DEFAULT_SHARED_WRITER;
+	self->engine.ring_depth = DEFAULT_RING_DEPTH;
+	self->engine.use_uring = DEFAULT_IO_URING;
+	self->engine.use_splice = DEFAULT_SPLICE;
+	device_init(&self->device);
+	self->device.mock_rate = DEFAULT_MOCK_RATE;
+	self->device.mock_buffer_size = DEFAULT_MOCK_BUFFER_SIZE;
+	self->backend = DEFAULT_BACKEND;
+	self->adapter = DEFAULT_ADAPTER;
+	self->decoder_index = DEFAULT_DECODER_INDEX;
+	self->device_path = NULL;
+	self->capture_path = NULL;
+	self->keep_alive = DEFAULT_KEEP_ALIVE;
+	self->keep_alive_timeout = DEFAULT_KEEP_ALIVE_TIMEOUT;
 	self->rate = 1.0;
 	self->timestamp = GST_CLOCK_TIME_NONE;
 
@@ -277,15 +486,206 @@ static void gst_dvbaudiosink_init(GstDVBAudioSink *self, GstDVBAudioSinkClass *g
 	gst_base_sink_set_async_enabled(GST_BASE_SINK(self), TRUE);
 }
 
+static void gst_dvbaudiosink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(object);
+
+	switch (prop_id)
+	{
+	case PROP_MAX_QUEUE_BYTES:
+		GST_OBJECT_LOCK(self);
+		queue_set_watermarks(&self->engine.queue, g_value_get_uint(value), self->engine.queue.low_watermark);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_LOW_WATERMARK:
+		GST_OBJECT_LOCK(self);
+		queue_set_watermarks(&self->engine.queue, self->engine.queue.high_watermark, g_value_get_uint(value));
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_WRITER_THREAD:
+		GST_OBJECT_LOCK(self);
+		self->engine.threaded = g_value_get_boolean(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_SHARED_WRITER:
+		GST_OBJECT_LOCK(self);
+		self->engine.shared_writer = g_value_get_boolean(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_RING_DEPTH:
+		GST_OBJECT_LOCK(self);
+		self->engine.ring_depth = g_value_get_uint(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_IO_URING:
+		GST_OBJECT_LOCK(self);
+		self->engine.use_uring = g_value_get_boolean(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_SPLICE:
+		GST_OBJECT_LOCK(self);
+		self->engine.use_splice = g_value_get_boolean(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_BACKEND:
+		GST_OBJECT_LOCK(self);
+		self->backend = g_value_get_enum(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_ADAPTER:
+		GST_OBJECT_LOCK(self);
+		self->adapter = g_value_get_uint(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_DECODER_INDEX:
+		GST_OBJECT_LOCK(self);
+		self->decoder_index = g_value_get_uint(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_DEVICE:
+		GST_OBJECT_LOCK(self);
+		g_free(self->device_path);
+		self->device_path = g_value_dup_string(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_MOCK_RATE:
+		GST_OBJECT_LOCK(self);
+		self->device.mock_rate = g_value_get_uint64(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_MOCK_BUFFER_SIZE:
+		GST_OBJECT_LOCK(self);
+		self->device.mock_buffer_size = g_value_get_uint(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_KEEP_ALIVE:
+		GST_OBJECT_LOCK(self);
+		self->keep_alive = g_value_get_boolean(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_KEEP_ALIVE_TIMEOUT:
+		GST_OBJECT_LOCK(self);
+		self->keep_alive_timeout = g_value_get_uint(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_CAPTURE:
+		GST_OBJECT_LOCK(self);
+		g_free(self->capture_path);
+		self->capture_path = g_value_dup_string(value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_dvbaudiosink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(object);
+
+	switch (prop_id)
+	{
+	case PROP_MAX_QUEUE_BYTES:
+		g_value_set_uint(value, self->engine.queue.high_watermark);
+		break;
+	case PROP_LOW_WATERMARK:
+		g_value_set_uint(value, self->engine.queue.low_watermark);
+		break;
+	case PROP_QUEUE_BYTES:
+		GST_OBJECT_LOCK(self);
+		g_value_set_uint(value, self->engine.queue.bytes);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_WRITER_THREAD:
+		g_value_set_boolean(value, self->engine.threaded);
+		break;
+	case PROP_SHARED_WRITER:
+		g_value_set_boolean(value, self->engine.shared_writer);
+		break;
+	case PROP_RING_DEPTH:
+		g_value_set_uint(value, self->engine.ring_depth);
+		break;
+	case PROP_IO_URING:
+		g_value_set_boolean(value, self->engine.use_uring);
+		break;
+	case PROP_SPLICE:
+		g_value_set_boolean(value, self->engine.use_splice);
+		break;
+	case PROP_BYTES_WRITTEN:
+	case PROP_BYTES_SPLICED:
+	case PROP_SYSCALLS:
+	{
+		guint64 written, spliced, syscalls;
+		write_engine_get_stats(&self->engine, &written, &spliced, &syscalls);
+		g_value_set_uint64(value, prop_id == PROP_BYTES_WRITTEN ? written : prop_id == PROP_BYTES_SPLICED ? spliced : syscalls);
+		break;
+	}
+	case PROP_BACKEND:
+		g_value_set_enum(value, self->backend);
+		break;
+	case PROP_ADAPTER:
+		g_value_set_uint(value, self->adapter);
+		break;
+	case PROP_DECODER_INDEX:
+		g_value_set_uint(value, self->decoder_index);
+		break;
+	case PROP_DEVICE:
+		GST_OBJECT_LOCK(self);
+		g_value_set_string(value, self->device_path);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_MOCK_RATE:
+		g_value_set_uint64(value, self->device.mock_rate);
+		break;
+	case PROP_MOCK_BUFFER_SIZE:
+		g_value_set_uint(value, self->device.mock_buffer_size);
+		break;
+	case PROP_KEEP_ALIVE:
+		g_value_set_boolean(value, self->keep_alive);
+		break;
+	case PROP_KEEP_ALIVE_TIMEOUT:
+		g_value_set_uint(value, self->keep_alive_timeout);
+		break;
+	case PROP_CAPTURE:
+		GST_OBJECT_LOCK(self);
+		g_value_set_string(value, self->capture_path);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_dvbaudiosink_finalize(GObject *object)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(object);
+
+	g_free(self->device_path);
+	g_free(self->capture_path);
+
+	G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+/* the release-parked action, for the application to get the decoders back
+ * that keep-alive left open */
+static void gst_dvbaudiosink_release_parked(GstDVBAudioSink *self)
+{
+	GST_DEBUG_OBJECT(self, "releasing parked decoders");
+	device_release_parked();
+}
+
 static gint64 gst_dvbaudiosink_get_decoder_time(GstDVBAudioSink *self)
 {
 	gint64 cur = 0;
-	if (self->fd < 0 || !self->playing || !self->pts_written) return GST_CLOCK_TIME_NONE;
+	if (self->engine.fd < 0 || !self->playing || !self->pts_written) return GST_CLOCK_TIME_NONE;
 
-	ioctl(self->fd, AUDIO_GET_PTS, &cur);
+	device_ioctl(&self->device, AUDIO_GET_PTS, (unsigned long)&cur);
 	if (cur)
 	{
 		self->lastpts = cur;
+		write_engine_decoder_pts(&self->engine);
 	}
 	else
 	{
@@ -295,12 +695,24 @@ static gint64 gst_dvbaudiosink_get_decoder_time(GstDVBAudioSink *self)
 	return cur - self->timestamp_offset;
 }
 
+/* the video decoder paired with ours, for trick modes, there is none with the other backends */
+static int gst_dvbaudiosink_open_video(GstDVBAudioSink *self)
+{
+	gchar *path;
+	int fd;
+	if (self->backend != DEVICE_BACKEND_DVB) return -1;
+	GST_OBJECT_LOCK(self);
+	path = device_dvb_path("video", self->adapter, self->decoder_index);
+	GST_OBJECT_UNLOCK(self);
+	fd = open(path, O_RDWR);
+	g_free(path);
+	return fd;
+}
+
 static gboolean gst_dvbaudiosink_unlock(GstBaseSink *basesink)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
-	self->unlocking = TRUE;
-	/* wakeup the poll */
-	write(self->unlockfd[1], "\x01", 1);
+	write_engine_set_unlocking(&self->engine, TRUE);
 	GST_DEBUG_OBJECT(basesink, "unlock");
 	return TRUE;
 }
@@ -308,60 +720,32 @@ static gboolean gst_dvbaudiosink_unlock(GstBaseSink *basesink)
 static gboolean gst_dvbaudiosink_unlock_stop(GstBaseSink *basesink)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
-	self->unlocking = FALSE;
+	write_engine_set_unlocking(&self->engine, FALSE);
 	GST_DEBUG_OBJECT(basesink, "unlock_stop");
 	return TRUE;
 }
 
-#ifdef HAVE_DTSDOWNMIX
-static gboolean get_downmix_setting()
+static GstCaps *gst_dvbaudiosink_get_caps(GstBaseSink *basesink)
 {
-	FILE *f;
-	char buffer[32] = {0};
-	f = fopen("/proc/stb/audio/ac3", "r");
-	if (f)
-	{
-		fread(buffer, sizeof(buffer), 1, f);
-		fclose(f);
-	}
-	return !strncmp(buffer, "downmix", 7);
+	GstDVBAudioSinkClass *klass = GST_DVBAUDIOSINK_GET_CLASS(basesink);
+
+	if (g_atomic_int_get(&klass->downmix)) return gst_caps_ref(klass->caps_without_dts);
+	return gst_caps_ref(klass->caps);
 }
-#endif
 
-static GstCaps *gst_dvbaudiosink_get_caps(GstBaseSink *basesink)
+/* re-read the downmix setting, for the next negotiation to pick the matching caps */
+static void gst_dvbaudiosink_refresh_caps(GstDVBAudioSink *self)
 {
-	GstCaps *caps = gst_caps_from_string(
-		MPEGCAPS 
-		AC3CAPS
-#ifdef HAVE_EAC3
-		EAC3CAPS
-#endif
-#ifdef HAVE_LPCM
-		LPCMCAPS
-#endif
-#ifdef HAVE_WMA
-		WMACAPS
-#endif
-#ifdef HAVE_AMR
-		AMRCAPS
-#endif
-#ifdef HAVE_PCM
-		PCMCAPS
-#endif
-	);
+#ifdef HAVE_DTSDOWNMIX
+	GstDVBAudioSinkClass *klass = GST_DVBAUDIOSINK_GET_CLASS(self);
+	gboolean downmix = get_downmix_setting();
 
-#ifdef HAVE_DTS
-# ifdef HAVE_DTSDOWNMIX
-	if (!get_downmix_setting())
+	if (g_atomic_int_get(&klass->downmix) != downmix)
 	{
-		gst_caps_append(caps, gst_caps_from_string(DTSCAPS));
+		GST_DEBUG_OBJECT(self, "DTS downmix %s", downmix ? "on" : "off");
+		g_atomic_int_set(&klass->downmix, downmix);
 	}
-# else
-	gst_caps_append(caps, gst_caps_from_string(DTSCAPS));
-# endif
 #endif
-
-	return caps;
 }
 
 static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
@@ -633,15 +1017,19 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 
 	if (self->playing)
 	{
-		if (self->fd >= 0) ioctl(self->fd, AUDIO_STOP, 0);
+		if (self->engine.fd >= 0) device_ioctl(&self->device, AUDIO_STOP, 0);
 		self->playing = FALSE;
 	}
-	if (self->fd < 0 || ioctl(self->fd, AUDIO_SET_BYPASS_MODE, bypass) < 0)
+	if (self->engine.fd >= 0 && self->device.stream_type == bypass)
+	{
+		GST_DEBUG_OBJECT(self, "decoder already in bypass mode 0x%02x", bypass);
+	}
+	else if (self->engine.fd < 0 || device_ioctl(&self->device, AUDIO_SET_BYPASS_MODE, bypass) < 0)
 	{
 		GST_ELEMENT_ERROR(self, STREAM, TYPE_NOT_FOUND,(NULL),("hardware decoder can't be set to bypass mode type %s", type));
 		return FALSE;
 	}
-	if (self->fd >= 0) ioctl(self->fd, AUDIO_PLAY);
+	if (self->engine.fd >= 0) device_ioctl(&self->device, AUDIO_PLAY, 0);
 	self->playing = TRUE;
 
 	self->bypass = bypass;
@@ -657,18 +1045,12 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 	switch (GST_EVENT_TYPE(event))
 	{
 	case GST_EVENT_FLUSH_START:
-		self->flushing = TRUE;
-		/* wakeup the poll */
-		write(self->unlockfd[1], "\x01", 1);
+		write_engine_set_flushing(&self->engine, TRUE);
 		break;
 	case GST_EVENT_FLUSH_STOP:
-		if (self->fd >= 0) ioctl(self->fd, AUDIO_CLEAR_BUFFER);
+		write_engine_flush(&self->engine);
+		if (self->engine.fd >= 0) device_ioctl(&self->device, AUDIO_CLEAR_BUFFER, 0);
 		GST_OBJECT_LOCK(self);
-		while (self->queue)
-		{
-			queue_pop(&self->queue);
-		}
-		self->flushing = FALSE;
 		self->timestamp = GST_CLOCK_TIME_NONE;
 		self->fixed_buffertimestamp = GST_CLOCK_TIME_NONE;
 		if (self->cache)
@@ -680,43 +1062,8 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 		break;
 	case GST_EVENT_EOS:
 	{
-		struct pollfd pfd[2];
-		pfd[0].fd = self->unlockfd[0];
-		pfd[0].events = POLLIN;
-		pfd[1].fd = self->fd;
-		pfd[1].events = POLLIN;
-
 		GST_PAD_PREROLL_UNLOCK(sink->sinkpad);
-		while (1)
-		{
-			int retval = poll(pfd, 2, 250);
-			if (retval < 0)
-			{
-				perror("poll in EVENT_EOS");
-				ret = FALSE;
-				break;
-			}
-
-			if (pfd[0].revents & POLLIN)
-			{
-				GST_DEBUG_OBJECT(self, "wait EOS aborted!!\n");
-				ret = FALSE;
-				break;
-			}
-
-			if (pfd[1].revents & POLLIN)
-			{
-				GST_DEBUG_OBJECT(self, "got buffer empty from driver!\n");
-				break;
-			}
-
-			if (sink->flushing)
-			{
-				GST_DEBUG_OBJECT(self, "wait EOS flushing!!\n");
-				ret = FALSE;
-				break;
-			}
-		}
+		ret = write_engine_wait_eos(&self->engine);
 		GST_PAD_PREROLL_LOCK(sink->sinkpad);
 
 		break;
@@ -735,7 +1082,8 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 			self->timestamp_offset = start - pos;
 			if (rate != self->rate)
 			{
-				int video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
+				/* trick mode goes through the real video decoder */
+				int video_fd = gst_dvbaudiosink_open_video(self);
 				if (video_fd >= 0)
 				{
 					if (rate > 1.0)
@@ -764,110 +1112,6 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 	return ret;
 }
 
-static int audio_write(GstDVBAudioSink *self, GstBuffer *buffer, size_t start, size_t end)
-{
-	size_t written = start;
-	size_t len = end;
-	struct pollfd pfd[2];
-
-	pfd[0].fd = self->unlockfd[0];
-	pfd[0].events = POLLIN;
-	pfd[1].fd = self->fd;
-	pfd[1].events = POLLOUT;
-
-	do
-	{
-		if (self->flushing)
-		{
-			GST_DEBUG_OBJECT(self, "flushing, skip %d bytes", len - written);
-			break;
-		}
-		else if (self->paused || self->unlocking)
-		{
-			GST_OBJECT_LOCK(self);
-			queue_push(&self->queue, buffer, written, end);
-			GST_OBJECT_UNLOCK(self);
-			GST_DEBUG_OBJECT(self, "pushed %d bytes to queue", len - written);
-			break;
-		}
-		else
-		{
-			GST_LOG_OBJECT(self, "going into poll, have %d bytes to write", len - written);
-		}
-		if (poll(pfd, 2, -1) < 0)
-		{
-			if (errno == EINTR) continue;
-			return -1;
-		}
-		if (pfd[0].revents & POLLIN)
-		{
-			/* read all stop commands */
-			while (1)
-			{
-				gchar command;
-				int res = read(self->unlockfd[0], &command, 1);
-				if (res < 0)
-				{
-					GST_DEBUG_OBJECT(self, "no more commands");
-					/* no more commands */
-					break;
-				}
-			}
-			continue;
-		}
-		if (pfd[1].revents & POLLOUT)
-		{
-			size_t queuestart, queueend;
-			GstBuffer *queuebuffer;
-			GST_OBJECT_LOCK(self);
-			if (queue_front(&self->queue, &queuebuffer, &queuestart, &queueend) >= 0)
-			{
-				int wr = write(self->fd, GST_BUFFER_DATA(queuebuffer) + queuestart, queueend - queuestart);
-				if (wr < 0)
-				{
-					switch(errno)
-					{
-						case EINTR:
-						case EAGAIN:
-							break;
-						default:
-							GST_OBJECT_UNLOCK(self);
-							return -3;
-					}
-				}
-				else if (wr >= queueend - queuestart)
-				{
-					queue_pop(&self->queue);
-					GST_DEBUG_OBJECT(self, "written %d queue bytes... pop entry", wr);
-				}
-				else
-				{
-					self->queue->start += wr;
-					GST_DEBUG_OBJECT(self, "written %d queue bytes... update offset", wr);
-				}
-				GST_OBJECT_UNLOCK(self);
-				continue;
-			}
-			GST_OBJECT_UNLOCK(self);
-			int wr = write(self->fd, GST_BUFFER_DATA(buffer) + written, len - written);
-			if (wr < 0)
-			{
-				switch(errno)
-				{
-					case EINTR:
-					case EAGAIN:
-						continue;
-					default:
-						return -3;
-				}
-			}
-			written += wr;
-		}
-	} while (written < len);
-
-	return 0;
-}
-
 GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buffer)
 {
 	unsigned char *pes_header = GST_BUFFER_DATA(self->pesheader_buffer);
@@ -876,6 +1120,7 @@ GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buf
 	unsigned char *data = GST_BUFFER_DATA(buffer);
 	GstClockTime timestamp = self->timestamp;
 	GstClockTime duration = GST_BUFFER_DURATION(buffer);
+	write_segment_t segments[2];
 	/* 
 	 * Some audioformats have incorrect timestamps, 
 	 * so if we have both a timestamp and a duration, 
@@ -914,17 +1159,8 @@ GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buf
 
 	if (self->bypass == AUDIOTYPE_DTS)
 	{
-		int pos = 0;
-		while ((pos + 4) <= size)
-		{
-			/* check for DTS-HD */
-			if (!strcmp((char*)(data + pos), "\x64\x58\x20\x25"))
-			{
-				size = pos;
-				break;
-			}
-			++pos;
-		}
+		/* drop the DTS-HD extension, the decoder only handles the core */
+		size = dts_find_hd_sync(data, size);
 	}
 
 	if (timestamp != GST_CLOCK_TIME_NONE)
@@ -1006,8 +1242,9 @@ GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buf
 
 	pes_set_payload_size(size + pes_header_len - 6, pes_header);
 
-	if (audio_write(self, self->pesheader_buffer, 0, pes_header_len) < 0) goto error;
-	if (audio_write(self, buffer, data - GST_BUFFER_DATA(buffer), (data - GST_BUFFER_DATA(buffer)) + size) < 0) goto error;
+	segments[0] = (write_segment_t) { NULL, pes_header, pes_header_len };
+	segments[1] = (write_segment_t) { buffer, data, size };
+	if (write_engine_write(&self->engine, segments, 2) < 0) goto error;
 	if (timestamp != GST_CLOCK_TIME_NONE)
 	{
 		self->pts_written = TRUE;
@@ -1036,7 +1273,7 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 		return GST_FLOW_ERROR;
 	}
 
-	if (self->fd < 0) return GST_FLOW_ERROR;
+	if (self->engine.fd < 0) return GST_FLOW_ERROR;
 
 	if (GST_BUFFER_IS_DISCONT(buffer)) 
 	{
@@ -1127,21 +1364,33 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 static gboolean gst_dvbaudiosink_start(GstBaseSink * basesink)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
+	gchar *device_path, *capture_path;
 
 	GST_DEBUG_OBJECT(self, "start");
 
-	if (socketpair(PF_UNIX, SOCK_STREAM, 0, self->unlockfd) < 0)
-	{
-		perror("socketpair");
-		goto error;
-	}
+	/* once per stream, the setting can change between streams */
+	gst_dvbaudiosink_refresh_caps(self);
 
-	fcntl(self->unlockfd[0], F_SETFL, O_NONBLOCK);
-	fcntl(self->unlockfd[1], F_SETFL, O_NONBLOCK);
+	if (write_engine_start(&self->engine) < 0) goto error;
 
 	self->pesheader_buffer = gst_buffer_new_and_alloc(256);
 
-	self->fd = open("/dev/dvb/adapter0/audio0", O_RDWR | O_NONBLOCK);
+	GST_OBJECT_LOCK(self);
+	device_path = self->device_path ? g_strdup(self->device_path) : device_dvb_path("audio", self->adapter, self->decoder_index);
+	self->engine.fd = device_open(&self->device, self->backend, device_path);
+	g_free(device_path);
+	capture_path = g_strdup(self->capture_path);
+	GST_OBJECT_UNLOCK(self);
+
+	if (capture_path)
+	{
+		self->engine.capture = self->device.capture = capture_open(capture_path);
+		if (!self->engine.capture)
+		{
+			GST_ELEMENT_WARNING(self, RESOURCE, OPEN_WRITE, (NULL), ("could not create capture %s: %s", capture_path, g_strerror(errno)));
+		}
+		g_free(capture_path);
+	}
 
 	self->pts_written = FALSE;
 	self->lastpts = 0;
@@ -1161,18 +1410,20 @@ static gboolean gst_dvbaudiosink_stop(GstBaseSink * basesink)
 
 	GST_DEBUG_OBJECT(self, "stop");
 
-	if (self->fd >= 0)
+	/* stop the writer thread before the device is closed */
+	write_engine_stop(&self->engine);
+
+	if (self->engine.fd >= 0)
 	{
 		if (self->playing)
 		{
-			ioctl(self->fd, AUDIO_STOP);
+			device_ioctl(&self->device, AUDIO_STOP, 0);
 			self->playing = FALSE;
 		}
-		ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_DEMUX);
 
 		if (self->rate != 1.0)
 		{
-			int video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
+			int video_fd = gst_dvbaudiosink_open_video(self);
 			if (video_fd >= 0)
 			{
 				ioctl(video_fd, VIDEO_SLOWMOTION, 0);
@@ -1181,10 +1432,23 @@ static gboolean gst_dvbaudiosink_stop(GstBaseSink * basesink)
 			}
 			self->rate = 1.0;
 		}
-		close(self->fd);
-		self->fd = -1;
+		if (self->keep_alive)
+		{
+			/* stays in memory source mode, with the bypass mode set, until taken over, released or timed out */
+			device_ioctl(&self->device, AUDIO_CLEAR_BUFFER, 0);
+			device_park(&self->device, self->keep_alive_timeout, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_DEMUX);
+		}
+		else
+		{
+			device_ioctl(&self->device, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_DEMUX);
+			device_close(&self->device);
+		}
+		self->engine.fd = -1;
 	}
 
+	capture_close(self->engine.capture);
+	self->engine.capture = self->device.capture = NULL;
+
 	if (self->codec_data)
 	{
 		gst_buffer_unref(self->codec_data);
@@ -1203,22 +1467,6 @@ static gboolean gst_dvbaudiosink_stop(GstBaseSink * basesink)
 		self->cache = NULL;
 	}
 
-	while (self->queue)
-	{
-		queue_pop(&self->queue);
-	}
-
-	/* close write end first */
-	if (self->unlockfd[1] >= 0)
-	{
-		close(self->unlockfd[1]);
-		self->unlockfd[1] = -1;
-	}
-	if (self->unlockfd[0] >= 0)
-	{
-		close(self->unlockfd[0]);
-		self->unlockfd[0] = -1;
-	}
 	return TRUE;
 }
 
@@ -1234,18 +1482,18 @@ static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement *element, G
 		break;
 	case GST_STATE_CHANGE_READY_TO_PAUSED:
 		GST_DEBUG_OBJECT(self,"GST_STATE_CHANGE_READY_TO_PAUSED");
-		self->paused = TRUE;
+		write_engine_set_paused(&self->engine, TRUE);
 
-		if (self->fd >= 0)
+		if (self->engine.fd >= 0)
 		{
-			ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_MEMORY);
-			ioctl(self->fd, AUDIO_PAUSE);
+			device_ioctl(&self->device, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_MEMORY);
+			device_ioctl(&self->device, AUDIO_PAUSE, 0);
 		}
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 		GST_DEBUG_OBJECT(self,"GST_STATE_CHANGE_PAUSED_TO_PLAYING");
-		if (self->fd >= 0) ioctl(self->fd, AUDIO_CONTINUE);
-		self->paused = FALSE;
+		if (self->engine.fd >= 0) device_ioctl(&self->device, AUDIO_CONTINUE, 0);
+		write_engine_set_paused(&self->engine, FALSE);
 		break;
 	default:
 		break;
@@ -1257,10 +1505,8 @@ static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement *element, G
 	{
 	case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
 		GST_DEBUG_OBJECT(self,"GST_STATE_CHANGE_PLAYING_TO_PAUSED");
-		self->paused = TRUE;
-		if (self->fd >= 0) ioctl(self->fd, AUDIO_PAUSE);
-		/* wakeup the poll */
-		write(self->unlockfd[1], "\x01", 1);
+		write_engine_set_paused(&self->engine, TRUE);
+		if (self->engine.fd >= 0) device_ioctl(&self->device, AUDIO_PAUSE, 0);
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_DEBUG_OBJECT(self,"GST_STATE_CHANGE_PAUSED_TO_READY");
@@ -1274,34 +1520,3 @@ static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement *element, G
 
 	return ret;
 }
-
-/* entry point to initialize the plug-in
- * initialize the plug-in itself
- * register the element factories and pad templates
- * register the features
- *
- * exchange the string 'plugin' with your elemnt name
- */
-static gboolean plugin_init(GstPlugin *plugin)
-{
-	return gst_element_register(plugin, "dvbaudiosink",
-						 GST_RANK_PRIMARY,
-						 GST_TYPE_DVBAUDIOSINK);
-}
-
-/* this is the structure that gstreamer looks for to register plugins
- *
- * exchange the strings 'plugin' and 'Template plugin' with you plugin name and
- * description
- */
-GST_PLUGIN_DEFINE(
-	GST_VERSION_MAJOR,
-	GST_VERSION_MINOR,
-	"dvb_audio_out",
-	"DVB Audio Output",
-	plugin_init,
-	VERSION,
-	"LGPL",
-	"GStreamer",
-	"http://gstreamer.net/"
-)
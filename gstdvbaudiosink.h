@@ -95,8 +95,14 @@ struct _GstDVBAudioSink
 	GstBuffer *codec_data;
 	GstBuffer *cache;
 
-	int fd;
-	int unlockfd[2];
+	write_engine_t engine;
+	device_t device;
+	device_backend_t backend;
+	guint adapter, decoder_index;
+	gchar *device_path;
+	gchar *capture_path;
+	gboolean keep_alive;
+	guint keep_alive_timeout;
 
 	int skip;
 	int bypass;
@@ -106,18 +112,24 @@ struct _GstDVBAudioSink
 
 	GstClockTime timestamp;
 	gdouble rate;
-	gboolean playing, paused, flushing, unlocking;
+	gboolean playing;
 	gboolean pts_written;
 	gint64 lastpts;
 	gint64 timestamp_offset;
-
-	queue_entry_t *queue;
 };
 
 struct _GstDVBAudioSinkClass
 {
 	GstBaseSinkClass parent_class;
 	gint64 (*get_decoder_time) (GstDVBAudioSink *sink);
+	void (*refresh_caps) (GstDVBAudioSink *sink);
+	void (*release_parked) (GstDVBAudioSink *sink);
+
+	/* what get_caps returns, parsed once in class_init */
+	GstCaps *caps;
+	GstCaps *caps_without_dts;
+	/* the box downmixes DTS, so only caps_without_dts are offered */
+	volatile gint downmix;
 };
 
 GType gst_dvbaudiosink_get_type (void);
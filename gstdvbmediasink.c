@@ -0,0 +1,62 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * The plugin registering all elements of the package, so that loading them
+ * takes a single library and a single registry entry.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+
+#include "common.h"
+#include "device.h"
+#include "gstdvbvideosink.h"
+#include "gstdvbaudiosink.h"
+#ifdef HAVE_DTSDOWNMIX
+#include "gstdtsdownmix.h"
+#endif
+
+static gboolean plugin_init(GstPlugin *plugin)
+{
+	if (!gst_element_register(plugin, "dvbvideosink", GST_RANK_PRIMARY, GST_TYPE_DVBVIDEOSINK))
+		return FALSE;
+	if (!gst_element_register(plugin, "dvbaudiosink", GST_RANK_PRIMARY, GST_TYPE_DVBAUDIOSINK))
+		return FALSE;
+#ifdef HAVE_DTSDOWNMIX
+	if (!gst_element_register(plugin, "dtsdownmix", GST_RANK_PRIMARY, GST_TYPE_DTSDOWNMIX))
+		return FALSE;
+#endif
+
+	return TRUE;
+}
+
+GST_PLUGIN_DEFINE(
+	GST_VERSION_MAJOR,
+	GST_VERSION_MINOR,
+	"dvbmediasink",
+	"DVB Audio and Video Output",
+	plugin_init,
+	VERSION,
+	"LGPL",
+	"GStreamer",
+	"http://gstreamer.net/"
+)
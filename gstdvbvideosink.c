@@ -64,6 +64,7 @@
 #include <config.h>
 #endif
 #include <unistd.h>
+#include <errno.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -79,77 +80,12 @@
 #define PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 
 #include "common.h"
+#include "device.h"
+#include "parse.h"
+#include "capture.h"
 #include "gstdvbvideosink.h"
 #include "gstdvbsink-marshal.h"
 
-#ifndef VIDEO_SET_CODEC_DATA
-typedef struct video_codec_data
-{
-	int length;
-	guint8 *data;
-} video_codec_data_t;
-#define VIDEO_SET_CODEC_DATA _IOW('o', 80, video_codec_data_t)
-#endif
-
-#ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
-struct bitstream
-{
-	guint8 *data;
-	guint8 last;
-	int avail;
-};
-
-void bitstream_init(struct bitstream *bit, const void *buffer, gboolean wr)
-{
-	bit->data = (guint8*) buffer;
-	if (wr) {
-		bit->avail = 0;
-		bit->last = 0;
-	}
-	else {
-		bit->avail = 8;
-		bit->last = *bit->data++;
-	}
-}
-
-unsigned long bitstream_get(struct bitstream *bit, int bits)
-{
-	unsigned long res = 0;
-	while (bits)
-	{
-		unsigned int d = bits;
-		if (!bit->avail)
-		{
-			bit->last = *bit->data++;
-			bit->avail = 8;
-		}
-		if (d > bit->avail)
-			d=bit->avail;
-		res<<=d;
-		res|=(bit->last>>(bit->avail-d))&~(-1<<d);
-		bit->avail -= d;
-		bits -= d;
-	}
-	return res;
-}
-
-void bitstream_put(struct bitstream *bit, unsigned long val, int bits)
-{
-	while (bits)
-	{
-		bit->last |= ((val & (1 << (bits-1))) ? 1 : 0) << (7 - bit->avail);
-		if (++bit->avail == 8)
-		{
-			*bit->data = bit->last;
-			++bit->data;
-			bit->last = 0;
-			bit->avail = 0;
-		}
-		--bits;
-	}
-}
-#endif
-
 GST_DEBUG_CATEGORY_STATIC (dvbvideosink_debug);
 #define GST_CAT_DEFAULT dvbvideosink_debug
 
@@ -166,11 +102,58 @@ GST_DEBUG_CATEGORY_STATIC (dvbvideosink_debug);
 enum
 {
 	SIGNAL_GET_DECODER_TIME,
+	SIGNAL_RELEASE_PARKED,
 	LAST_SIGNAL
 };
 
 static guint gst_dvb_videosink_signals[LAST_SIGNAL] = { 0 };
 
+enum
+{
+	PROP_0,
+	PROP_MAX_QUEUE_BYTES,
+	PROP_LOW_WATERMARK,
+	PROP_QUEUE_BYTES,
+	PROP_WRITER_THREAD,
+	PROP_SHARED_WRITER,
+	PROP_RING_DEPTH,
+	PROP_IO_URING,
+	PROP_SPLICE,
+	PROP_BYTES_WRITTEN,
+	PROP_BYTES_SPLICED,
+	PROP_SYSCALLS,
+	PROP_BACKEND,
+	PROP_ADAPTER,
+	PROP_DECODER_INDEX,
+	PROP_DEVICE,
+	PROP_MOCK_RATE,
+	PROP_MOCK_BUFFER_SIZE,
+	PROP_CAPTURE,
+	PROP_KEEP_ALIVE,
+	PROP_KEEP_ALIVE_TIMEOUT
+};
+
+#define DEFAULT_MAX_QUEUE_BYTES (8 * 1024 * 1024)
+#define DEFAULT_LOW_WATERMARK (2 * 1024 * 1024)
+#define DEFAULT_WRITER_THREAD FALSE
+#define DEFAULT_SHARED_WRITER FALSE
+#define DEFAULT_IO_URING FALSE
+#define DEFAULT_SPLICE FALSE
+#define DEFAULT_BACKEND DEVICE_BACKEND_DVB
+#define DEFAULT_ADAPTER 0
+#define DEFAULT_DECODER_INDEX 0
+#define DEFAULT_KEEP_ALIVE FALSE
+#define DEFAULT_KEEP_ALIVE_TIMEOUT 5
+#define DEFAULT_MOCK_RATE 0
+#define DEFAULT_MOCK_BUFFER_SIZE (2 * 1024 * 1024)
+#define DEFAULT_RING_DEPTH 256
+
+/* the most segments render puts before the frame: codec data, PES header and previous frame */
+#define FRAME_SEGMENTS_PREFIX 3
+
+/* MaxFS of H.264 level 4.1, in macroblocks */
+#define H264_LEVEL_41_MAX_FS 8192
+
 static GstStaticPadTemplate sink_factory =
 GST_STATIC_PAD_TEMPLATE (
 	"sink",
@@ -189,6 +172,10 @@ GST_STATIC_PAD_TEMPLATE (
 	"video/x-h264, "
 		VIDEO_CAPS "; "
 #endif
+#ifdef HAVE_H265
+	"video/x-h265, "
+		VIDEO_CAPS "; "
+#endif
 #ifdef HAVE_H263
 	"video/x-h263, "
 		VIDEO_CAPS "; "
@@ -244,6 +231,11 @@ static gboolean gst_dvbvideosink_unlock (GstBaseSink * basesink);
 static gboolean gst_dvbvideosink_unlock_stop (GstBaseSink * basesink);
 static GstStateChangeReturn gst_dvbvideosink_change_state (GstElement * element, GstStateChange transition);
 static gint64 gst_dvbvideosink_get_decoder_time (GstDVBVideoSink *self);
+static void gst_dvbvideosink_release_parked (GstDVBVideoSink *self);
+static void gst_dvbvideosink_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_dvbvideosink_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
+static void gst_dvbvideosink_finalize (GObject *object);
+static void gst_dvbvideosink_handle_event (GstElement *element);
 
 static void gst_dvbvideosink_base_init (gpointer self)
 {
@@ -276,6 +268,91 @@ static void gst_dvbvideosink_class_init (GstDVBVideoSinkClass *self)
 
 	element_class->change_state = GST_DEBUG_FUNCPTR (gst_dvbvideosink_change_state);
 
+	gobject_class->set_property = gst_dvbvideosink_set_property;
+	gobject_class->get_property = gst_dvbvideosink_get_property;
+	gobject_class->finalize = gst_dvbvideosink_finalize;
+
+	g_object_class_install_property (gobject_class, PROP_MAX_QUEUE_BYTES,
+		g_param_spec_uint ("max-queue-bytes", "Max queue bytes",
+			"Block rendering when this many bytes are queued while paused (0 = unlimited)",
+			0, G_MAXUINT, DEFAULT_MAX_QUEUE_BYTES, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_LOW_WATERMARK,
+		g_param_spec_uint ("low-watermark", "Low watermark",
+			"Resume queueing when a full queue has drained to this many bytes",
+			0, G_MAXUINT, DEFAULT_LOW_WATERMARK, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_QUEUE_BYTES,
+		g_param_spec_uint ("queue-bytes", "Queue bytes",
+			"Number of bytes currently queued",
+			0, G_MAXUINT, 0, G_PARAM_READABLE));
+	g_object_class_install_property (gobject_class, PROP_WRITER_THREAD,
+		g_param_spec_boolean ("writer-thread", "Writer thread",
+			"Write to the device from a dedicated thread, so rendering doesn't block on the decoder (takes effect on start)",
+			DEFAULT_WRITER_THREAD, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_SHARED_WRITER,
+		g_param_spec_boolean ("shared-writer", "Shared writer",
+			"Write to the device from one epoll thread shared by all dvb sinks, instead of a writer thread per sink (takes effect on start)",
+			DEFAULT_SHARED_WRITER, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_RING_DEPTH,
+		g_param_spec_uint ("ring-depth", "Ring depth",
+			"Number of buffer references between render and the (shared) writer thread (takes effect on start)",
+			2, 65536, DEFAULT_RING_DEPTH, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_IO_URING,
+		g_param_spec_boolean ("io-uring", "io_uring",
+			"Write to the device through io_uring when the kernel supports it, instead of poll and writev (takes effect on start)",
+			DEFAULT_IO_URING, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_SPLICE,
+		g_param_spec_boolean ("splice", "Splice",
+			"Move large writes to the device with vmsplice and splice instead of copying them, falls back to write when the device doesn't support it (takes effect on start)",
+			DEFAULT_SPLICE, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_BYTES_WRITTEN,
+		g_param_spec_uint64 ("bytes-written", "Bytes written",
+			"Number of bytes copied to the device with write since start",
+			0, G_MAXUINT64, 0, G_PARAM_READABLE));
+	g_object_class_install_property (gobject_class, PROP_BYTES_SPLICED,
+		g_param_spec_uint64 ("bytes-spliced", "Bytes spliced",
+			"Number of bytes moved to the device with splice since start",
+			0, G_MAXUINT64, 0, G_PARAM_READABLE));
+	g_object_class_install_property (gobject_class, PROP_SYSCALLS,
+		g_param_spec_uint64 ("syscalls", "System calls",
+			"Number of writes, polls, splices and io_uring submissions on the device since start",
+			0, G_MAXUINT64, 0, G_PARAM_READABLE));
+	g_object_class_install_property (gobject_class, PROP_BACKEND,
+		g_param_spec_enum ("backend", "Backend",
+			"Where the data goes: the dvb decoder, a file or FIFO, or an in-process mock decoder (takes effect on start)",
+			DEVICE_TYPE_BACKEND, DEFAULT_BACKEND, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_ADAPTER,
+		g_param_spec_uint ("adapter", "Adapter",
+			"DVB adapter of the decoder (takes effect on start)",
+			0, G_MAXUINT, DEFAULT_ADAPTER, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_DECODER_INDEX,
+		g_param_spec_uint ("decoder-index", "Decoder index",
+			"Which of the decoders of the adapter to use, on boxes with more than one (takes effect on start)",
+			0, G_MAXUINT, DEFAULT_DECODER_INDEX, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_DEVICE,
+		g_param_spec_string ("device", "Device",
+			"Decoder device for the dvb backend, or the file or FIFO to write for the file backend (NULL = /dev/dvb/adapter<adapter>/video<decoder-index>, takes effect on start)",
+			NULL, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_MOCK_RATE,
+		g_param_spec_uint64 ("mock-rate", "Mock rate",
+			"Bytes per second the mock backend drains data without PTS at while playing (0 = as fast as possible, takes effect on start)",
+			0, G_MAXUINT64, DEFAULT_MOCK_RATE, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_MOCK_BUFFER_SIZE,
+		g_param_spec_uint ("mock-buffer-size", "Mock buffer size",
+			"Size of the decoder buffer the mock backend emulates, in bytes (takes effect on start)",
+			4096, G_MAXUINT, DEFAULT_MOCK_BUFFER_SIZE, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_CAPTURE,
+		g_param_spec_string ("capture", "Capture",
+			"File to record everything fed to the decoder to, with an index in <file>.idx for dvbreplay (NULL = off, takes effect on start)",
+			NULL, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_KEEP_ALIVE,
+		g_param_spec_boolean ("keep-alive", "Keep alive",
+			"Leave the decoder open in memory source mode on stop, for the next sink on the same decoder to take over, which saves reopening and setting it up when zapping",
+			DEFAULT_KEEP_ALIVE, G_PARAM_READWRITE));
+	g_object_class_install_property (gobject_class, PROP_KEEP_ALIVE_TIMEOUT,
+		g_param_spec_uint ("keep-alive-timeout", "Keep alive timeout",
+			"Seconds a decoder left open by keep-alive waits to be taken over, before it is switched back to the demux and closed (0 = until release-parked or exit)",
+			0, G_MAXUINT, DEFAULT_KEEP_ALIVE_TIMEOUT, G_PARAM_READWRITE));
+
 	gst_dvb_videosink_signals[SIGNAL_GET_DECODER_TIME] =
 		g_signal_new ("get-decoder-time",
 		G_TYPE_FROM_CLASS (self),
@@ -283,10 +360,18 @@ static void gst_dvbvideosink_class_init (GstDVBVideoSinkClass *self)
 		G_STRUCT_OFFSET (GstDVBVideoSinkClass, get_decoder_time),
 		NULL, NULL, gst_dvbsink_marshal_INT64__VOID, G_TYPE_INT64, 0);
 
+	gst_dvb_videosink_signals[SIGNAL_RELEASE_PARKED] =
+		g_signal_new ("release-parked",
+		G_TYPE_FROM_CLASS (self),
+		G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+		G_STRUCT_OFFSET (GstDVBVideoSinkClass, release_parked),
+		NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+
 	self->get_decoder_time = gst_dvbvideosink_get_decoder_time;
-}
+	self->release_parked = gst_dvbvideosink_release_parked;
 
-#define H264_BUFFER_SIZE (64*1024+2048)
+	self->startcode = h264_startcode_buffer_new ();
+}
 
 /* initialize the new element
  * instantiate pads and add them to element
@@ -296,8 +381,10 @@ static void gst_dvbvideosink_class_init (GstDVBVideoSinkClass *self)
 static void gst_dvbvideosink_init (GstDVBVideoSink *self, GstDVBVideoSinkClass *gclass)
 {
 	self->must_send_header = TRUE;
-	self->h264_nal_len_size = 0;
+	self->nal_len_size = 0;
 	self->pesheader_buffer = NULL;
+	self->frame_segments = NULL;
+	self->frame_segments_max = 0;
 	self->codec_data = NULL;
 	self->codec_type = CT_H264;
 	self->stream_type = STREAMTYPE_UNKNOWN;
@@ -306,13 +393,27 @@ static void gst_dvbvideosink_init (GstDVBVideoSink *self, GstDVBVideoSinkClass *
 	self->num_non_keyframes = 0;
 	self->prev_frame = NULL;
 #endif
-	self->paused = self->playing = self->unlocking = self->flushing = FALSE;
+	self->playing = FALSE;
 	self->pts_written = FALSE;
 	self->lastpts = 0;
 	self->timestamp_offset = 0;
-	self->queue = NULL;
-	self->fd = -1;
-	self->unlockfd[0] = self->unlockfd[1] = -1;
+	write_engine_init(&self->engine, GST_ELEMENT(self), gst_dvbvideosink_handle_event);
+	queue_set_watermarks(&self->engine.queue, DEFAULT_MAX_QUEUE_BYTES, DEFAULT_LOW_WATERMARK);
+	self->engine.threaded = DEFAULT_WRITER_THREAD;
+	self->engine.shared_writer = DEFAULT_SHARED_WRITER;
+	self->engine.ring_depth = DEFAULT_RING_DEPTH;
+	self->engine.use_uring = DEFAULT_IO_URING;
+	self->engine.use_splice = DEFAULT_SPLICE;
+	device_init(&self->device);
+	self->device.mock_rate = DEFAULT_MOCK_RATE;
+	self->device.mock_buffer_size = DEFAULT_MOCK_BUFFER_SIZE;
+	self->backend = DEFAULT_BACKEND;
+	self->adapter = DEFAULT_ADAPTER;
+	self->decoder_index = DEFAULT_DECODER_INDEX;
+	self->device_path = NULL;
+	self->capture_path = NULL;
+	self->keep_alive = DEFAULT_KEEP_ALIVE;
+	self->keep_alive_timeout = DEFAULT_KEEP_ALIVE_TIMEOUT;
 	self->saved_fallback_framerate[0] = 0;
 	self->rate = 1.0;
 
@@ -320,15 +421,207 @@ static void gst_dvbvideosink_init (GstDVBVideoSink *self, GstDVBVideoSinkClass *
 	gst_base_sink_set_async_enabled(GST_BASE_SINK(self), TRUE);
 }
 
+static void gst_dvbvideosink_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK (object);
+
+	switch (prop_id)
+	{
+	case PROP_MAX_QUEUE_BYTES:
+		GST_OBJECT_LOCK(self);
+		queue_set_watermarks(&self->engine.queue, g_value_get_uint (value), self->engine.queue.low_watermark);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_LOW_WATERMARK:
+		GST_OBJECT_LOCK(self);
+		queue_set_watermarks(&self->engine.queue, self->engine.queue.high_watermark, g_value_get_uint (value));
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_WRITER_THREAD:
+		GST_OBJECT_LOCK(self);
+		self->engine.threaded = g_value_get_boolean (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_SHARED_WRITER:
+		GST_OBJECT_LOCK(self);
+		self->engine.shared_writer = g_value_get_boolean (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_RING_DEPTH:
+		GST_OBJECT_LOCK(self);
+		self->engine.ring_depth = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_IO_URING:
+		GST_OBJECT_LOCK(self);
+		self->engine.use_uring = g_value_get_boolean (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_SPLICE:
+		GST_OBJECT_LOCK(self);
+		self->engine.use_splice = g_value_get_boolean (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_BACKEND:
+		GST_OBJECT_LOCK(self);
+		self->backend = g_value_get_enum (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_ADAPTER:
+		GST_OBJECT_LOCK(self);
+		self->adapter = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_DECODER_INDEX:
+		GST_OBJECT_LOCK(self);
+		self->decoder_index = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_DEVICE:
+		GST_OBJECT_LOCK(self);
+		g_free (self->device_path);
+		self->device_path = g_value_dup_string (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_MOCK_RATE:
+		GST_OBJECT_LOCK(self);
+		self->device.mock_rate = g_value_get_uint64 (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_MOCK_BUFFER_SIZE:
+		GST_OBJECT_LOCK(self);
+		self->device.mock_buffer_size = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_KEEP_ALIVE:
+		GST_OBJECT_LOCK(self);
+		self->keep_alive = g_value_get_boolean (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_KEEP_ALIVE_TIMEOUT:
+		GST_OBJECT_LOCK(self);
+		self->keep_alive_timeout = g_value_get_uint (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_CAPTURE:
+		GST_OBJECT_LOCK(self);
+		g_free (self->capture_path);
+		self->capture_path = g_value_dup_string (value);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_dvbvideosink_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK (object);
+
+	switch (prop_id)
+	{
+	case PROP_MAX_QUEUE_BYTES:
+		g_value_set_uint (value, self->engine.queue.high_watermark);
+		break;
+	case PROP_LOW_WATERMARK:
+		g_value_set_uint (value, self->engine.queue.low_watermark);
+		break;
+	case PROP_QUEUE_BYTES:
+		GST_OBJECT_LOCK(self);
+		g_value_set_uint (value, self->engine.queue.bytes);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_WRITER_THREAD:
+		g_value_set_boolean (value, self->engine.threaded);
+		break;
+	case PROP_SHARED_WRITER:
+		g_value_set_boolean (value, self->engine.shared_writer);
+		break;
+	case PROP_RING_DEPTH:
+		g_value_set_uint (value, self->engine.ring_depth);
+		break;
+	case PROP_IO_URING:
+		g_value_set_boolean (value, self->engine.use_uring);
+		break;
+	case PROP_SPLICE:
+		g_value_set_boolean (value, self->engine.use_splice);
+		break;
+	case PROP_BYTES_WRITTEN:
+	case PROP_BYTES_SPLICED:
+	case PROP_SYSCALLS:
+	{
+		guint64 written, spliced, syscalls;
+		write_engine_get_stats(&self->engine, &written, &spliced, &syscalls);
+		g_value_set_uint64 (value, prop_id == PROP_BYTES_WRITTEN ? written : prop_id == PROP_BYTES_SPLICED ? spliced : syscalls);
+		break;
+	}
+	case PROP_BACKEND:
+		g_value_set_enum (value, self->backend);
+		break;
+	case PROP_ADAPTER:
+		g_value_set_uint (value, self->adapter);
+		break;
+	case PROP_DECODER_INDEX:
+		g_value_set_uint (value, self->decoder_index);
+		break;
+	case PROP_DEVICE:
+		GST_OBJECT_LOCK(self);
+		g_value_set_string (value, self->device_path);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_MOCK_RATE:
+		g_value_set_uint64 (value, self->device.mock_rate);
+		break;
+	case PROP_MOCK_BUFFER_SIZE:
+		g_value_set_uint (value, self->device.mock_buffer_size);
+		break;
+	case PROP_KEEP_ALIVE:
+		g_value_set_boolean (value, self->keep_alive);
+		break;
+	case PROP_KEEP_ALIVE_TIMEOUT:
+		g_value_set_uint (value, self->keep_alive_timeout);
+		break;
+	case PROP_CAPTURE:
+		GST_OBJECT_LOCK(self);
+		g_value_set_string (value, self->capture_path);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_dvbvideosink_finalize (GObject *object)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK (object);
+
+	g_free (self->device_path);
+	g_free (self->capture_path);
+	g_free (self->frame_segments);
+
+	G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+/* the release-parked action, for the application to get the decoders back
+ * that keep-alive left open */
+static void gst_dvbvideosink_release_parked(GstDVBVideoSink *self)
+{
+	GST_DEBUG_OBJECT(self, "releasing parked decoders");
+	device_release_parked();
+}
+
 static gint64 gst_dvbvideosink_get_decoder_time(GstDVBVideoSink *self)
 {
 	gint64 cur = 0;
-	if (self->fd < 0 || !self->playing || !self->pts_written) return GST_CLOCK_TIME_NONE;
+	if (self->engine.fd < 0 || !self->playing || !self->pts_written) return GST_CLOCK_TIME_NONE;
 
-	ioctl(self->fd, VIDEO_GET_PTS, &cur);
+	device_ioctl(&self->device, VIDEO_GET_PTS, (unsigned long)&cur);
 	if (cur)
 	{
 		self->lastpts = cur;
+		write_engine_decoder_pts(&self->engine);
 	}
 	else
 	{
@@ -338,12 +631,23 @@ static gint64 gst_dvbvideosink_get_decoder_time(GstDVBVideoSink *self)
 	return cur - self->timestamp_offset;
 }
 
+/* the fallback framerate setting of our decoder, in /proc/stb/vmpeg/<decoder-index> */
+static FILE *gst_dvbvideosink_open_fallback_framerate(GstDVBVideoSink *self, const char *mode)
+{
+	gchar *path;
+	FILE *f;
+	GST_OBJECT_LOCK(self);
+	path = g_strdup_printf("/proc/stb/vmpeg/%u/fallback_framerate", self->decoder_index);
+	GST_OBJECT_UNLOCK(self);
+	f = fopen(path, mode);
+	g_free(path);
+	return f;
+}
+
 static gboolean gst_dvbvideosink_unlock(GstBaseSink *basesink)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (basesink);
-	self->unlocking = TRUE;
-	/* wakeup the poll */
-	write(self->unlockfd[1], "\x01", 1);
+	write_engine_set_unlocking(&self->engine, TRUE);
 	GST_DEBUG_OBJECT(basesink, "unlock");
 	return TRUE;
 }
@@ -351,7 +655,7 @@ static gboolean gst_dvbvideosink_unlock(GstBaseSink *basesink)
 static gboolean gst_dvbvideosink_unlock_stop(GstBaseSink *basesink)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (basesink);
-	self->unlocking = FALSE;
+	write_engine_set_unlocking(&self->engine, FALSE);
 	GST_DEBUG_OBJECT(basesink, "unlock_stop");
 	return TRUE;
 }
@@ -365,60 +669,19 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 	switch (GST_EVENT_TYPE (event))
 	{
 	case GST_EVENT_FLUSH_START:
-		self->flushing = TRUE;
-		/* wakeup the poll */
-		write(self->unlockfd[1], "\x01", 1);
+		write_engine_set_flushing(&self->engine, TRUE);
 		break;
 	case GST_EVENT_FLUSH_STOP:
-		if (self->fd >= 0) ioctl(self->fd, VIDEO_CLEAR_BUFFER);
 		GST_OBJECT_LOCK(self);
 		self->must_send_header = TRUE;
-		while (self->queue)
-		{
-			queue_pop(&self->queue);
-		}
-		self->flushing = FALSE;
 		GST_OBJECT_UNLOCK(self);
+		write_engine_flush(&self->engine);
+		if (self->engine.fd >= 0) device_ioctl(&self->device, VIDEO_CLEAR_BUFFER, 0);
 		break;
 	case GST_EVENT_EOS:
 	{
-		struct pollfd pfd[2];
-		pfd[0].fd = self->unlockfd[0];
-		pfd[0].events = POLLIN;
-		pfd[1].fd = self->fd;
-		pfd[1].events = POLLIN;
-
 		GST_PAD_PREROLL_UNLOCK(sink->sinkpad);
-		while (1)
-		{
-			int retval = poll(pfd, 2, 250);
-			if (retval < 0)
-			{
-				perror("poll in EVENT_EOS");
-				ret = FALSE;
-				break;
-			}
-
-			if (pfd[0].revents & POLLIN)
-			{
-				GST_DEBUG_OBJECT (self, "wait EOS aborted!!\n");
-				ret = FALSE;
-				break;
-			}
-
-			if (pfd[1].revents & POLLIN)
-			{
-				GST_DEBUG_OBJECT (self, "got buffer empty from driver!\n");
-				break;
-			}
-
-			if (sink->flushing)
-			{
-				GST_DEBUG_OBJECT (self, "wait EOS flushing!!\n");
-				ret = FALSE;
-				break;
-			}
-		}
+		ret = write_engine_wait_eos(&self->engine);
 		GST_PAD_PREROLL_LOCK(sink->sinkpad);
 
 		break;
@@ -445,8 +708,8 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 				{
 					repeat = 1.0 / rate;
 				}
-				ioctl(self->fd, VIDEO_SLOWMOTION, repeat);
-				ioctl(self->fd, VIDEO_FAST_FORWARD, skip);
+				device_ioctl(&self->device, VIDEO_SLOWMOTION, repeat);
+				device_ioctl(&self->device, VIDEO_FAST_FORWARD, skip);
 				self->rate = rate;
 			}
 		}
@@ -460,147 +723,58 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 	return ret;
 }
 
-static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buffer, size_t start, size_t end)
+/* called by the write engine when the decoder has an event pending */
+static void gst_dvbvideosink_handle_event(GstElement *element)
 {
-	size_t written = start;
-	size_t len = end;
-	struct pollfd pfd[2];
-
-	pfd[0].fd = self->unlockfd[0];
-	pfd[0].events = POLLIN;
-	pfd[1].fd = self->fd;
-	pfd[1].events = POLLOUT | POLLPRI;
-
-	do
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK (element);
+	GstStructure *s;
+	GstMessage *msg;
+	struct video_event evt;
+	if (device_ioctl(&self->device, VIDEO_GET_EVENT, (unsigned long)&evt) < 0)
 	{
-		if (self->flushing)
-		{
-			GST_DEBUG_OBJECT(self, "flushing, skip %d bytes", len - written);
-			break;
+		g_warning("failed to ioctl VIDEO_GET_EVENT!");
+	}
+	else
+	{
+		GST_INFO_OBJECT (self, "VIDEO_EVENT %d", evt.type);
+		if (evt.type == VIDEO_EVENT_SIZE_CHANGED) {
+			s = gst_structure_new ("eventSizeChanged",
+				"aspect_ratio", G_TYPE_INT, evt.u.size.aspect_ratio == 0 ? 2 : 3,
+				"width", G_TYPE_INT, evt.u.size.w,
+				"height", G_TYPE_INT, evt.u.size.h, NULL);
+			msg = gst_message_new_element (GST_OBJECT(self), s);
+			gst_element_post_message (GST_ELEMENT(self), msg);
 		}
-		else if (self->paused || self->unlocking)
+		else if (evt.type == VIDEO_EVENT_FRAME_RATE_CHANGED)
 		{
-			GST_OBJECT_LOCK(self);
-			queue_push(&self->queue, buffer, written, end);
-			GST_OBJECT_UNLOCK(self);
-			GST_DEBUG_OBJECT(self, "pushed %d bytes to queue", len - written);
-			break;
+			s = gst_structure_new ("eventFrameRateChanged",
+				"frame_rate", G_TYPE_INT, evt.u.frame_rate, NULL);
+			msg = gst_message_new_element (GST_OBJECT(self), s);
+			gst_element_post_message (GST_ELEMENT(self), msg);
 		}
-		else
+		else if (evt.type == 16 /*VIDEO_EVENT_PROGRESSIVE_CHANGED*/)
 		{
-			GST_LOG_OBJECT (self, "going into poll, have %d bytes to write", len - written);
+			s = gst_structure_new ("eventProgressiveChanged",
+				"progressive", G_TYPE_INT, evt.u.frame_rate, NULL);
+			msg = gst_message_new_element (GST_OBJECT(self), s);
+			gst_element_post_message (GST_ELEMENT(self), msg);
 		}
-		if (poll(pfd, 2, -1) < 0)
-		{
-			if (errno == EINTR) continue;
-			return -1;
-		}
-		if (pfd[0].revents & POLLIN)
+		else
 		{
-			/* read all stop commands */
-			while (1)
-			{
-				gchar command;
-				int res = read(self->unlockfd[0], &command, 1);
-				if (res < 0)
-				{
-					GST_DEBUG_OBJECT (self, "no more commands");
-					/* no more commands */
-					break;
-				}
-			}
+			g_warning ("unhandled DVBAPI Video Event %d", evt.type);
 		}
-		if (pfd[1].revents & POLLPRI)
-		{
-			GstStructure *s;
-			GstMessage *msg;
-			struct video_event evt;
-			if (ioctl(self->fd, VIDEO_GET_EVENT, &evt) < 0)
-			{
-				g_warning("failed to ioctl VIDEO_GET_EVENT!");
-			}
-			else
-			{
-				GST_INFO_OBJECT (self, "VIDEO_EVENT %d", evt.type);
-				if (evt.type == VIDEO_EVENT_SIZE_CHANGED) {
-					s = gst_structure_new ("eventSizeChanged",
-						"aspect_ratio", G_TYPE_INT, evt.u.size.aspect_ratio == 0 ? 2 : 3,
-						"width", G_TYPE_INT, evt.u.size.w,
-						"height", G_TYPE_INT, evt.u.size.h, NULL);
-					msg = gst_message_new_element (GST_OBJECT(sink), s);
-					gst_element_post_message (GST_ELEMENT(sink), msg);
-				}
-				else if (evt.type == VIDEO_EVENT_FRAME_RATE_CHANGED)
-				{
-					s = gst_structure_new ("eventFrameRateChanged",
-						"frame_rate", G_TYPE_INT, evt.u.frame_rate, NULL);
-					msg = gst_message_new_element (GST_OBJECT(sink), s);
-					gst_element_post_message (GST_ELEMENT(sink), msg);
-				}
-				else if (evt.type == 16 /*VIDEO_EVENT_PROGRESSIVE_CHANGED*/)
-				{
-					s = gst_structure_new ("eventProgressiveChanged",
-						"progressive", G_TYPE_INT, evt.u.frame_rate, NULL);
-					msg = gst_message_new_element (GST_OBJECT(sink), s);
-					gst_element_post_message (GST_ELEMENT(sink), msg);
-				}
-				else
-				{
-					g_warning ("unhandled DVBAPI Video Event %d", evt.type);
-				}
-			}
-		}
-		if (pfd[1].revents & POLLOUT)
-		{
-			size_t queuestart, queueend;
-			GstBuffer *queuebuffer;
-			GST_OBJECT_LOCK(self);
-			if (queue_front(&self->queue, &queuebuffer, &queuestart, &queueend) >= 0)
-			{
-				int wr = write(self->fd, GST_BUFFER_DATA(queuebuffer) + queuestart, queueend - queuestart);
-				if (wr < 0)
-				{
-					switch (errno)
-					{
-						case EINTR:
-						case EAGAIN:
-							break;
-						default:
-							GST_OBJECT_UNLOCK(self);
-							return -3;
-					}
-				}
-				else if (wr >= queueend - queuestart)
-				{
-					queue_pop(&self->queue);
-					GST_DEBUG_OBJECT (self, "written %d queue bytes... pop entry", wr);
-				}
-				else
-				{
-					self->queue->start += wr;
-					GST_DEBUG_OBJECT (self, "written %d queue bytes... update offset", wr);
-				}
-				GST_OBJECT_UNLOCK(self);
-				continue;
-			}
-			GST_OBJECT_UNLOCK(self);
-			int wr = write(self->fd, GST_BUFFER_DATA(buffer) + written, len - written);
-			if (wr < 0)
-			{
-				switch (errno)
-				{
-					case EINTR:
-					case EAGAIN:
-						continue;
-					default:
-						return -3;
-				}
-			}
-			written += wr;
-		}
-	} while (written < len);
+	}
+}
 
-	return 0;
+/* room for count frame segments, after FRAME_SEGMENTS_PREFIX for the PES header and what else goes before them */
+static write_segment_t *gst_dvbvideosink_frame_segments(GstDVBVideoSink *self, int count)
+{
+	if (!self->frame_segments || count > self->frame_segments_max)
+	{
+		self->frame_segments_max = MAX(count, MAX(2 * self->frame_segments_max, 64));
+		self->frame_segments = g_renew(write_segment_t, self->frame_segments, FRAME_SEGMENTS_PREFIX + self->frame_segments_max);
+	}
+	return self->frame_segments + FRAME_SEGMENTS_PREFIX;
 }
 
 static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffer)
@@ -611,13 +785,17 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 	unsigned char *pes_header = GST_BUFFER_DATA(self->pesheader_buffer);
 	size_t pes_header_len = 0;
 	size_t payload_len = 0;
-	GstBuffer *tmpbuf = NULL;
+	write_segment_t segments[4];
+	int segment_count = 0;
+	/* the frame as start codes and NAL units, when it is converted from AVCC or hvcC */
+	write_segment_t *frame_segments = NULL;
+	int frame_segment_count = 0;
 
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 	gboolean commit_prev_frame_data = FALSE, cache_prev_frame = FALSE;
 #endif
 
-	if (self->fd < 0) return GST_FLOW_OK;
+	if (self->engine.fd < 0) return GST_FLOW_OK;
 
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 	if (self->must_pack_bitstream)
@@ -626,11 +804,8 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 		unsigned int pos = 0;
 		while (pos < data_len)
 		{
-			if (memcmp(&data[pos], "\x00\x00\x01", 3))
-			{
-				pos++;
-				continue;
-			}
+			pos += find_sync(data + pos, data_len - pos, "\x00\x00\x01", 3);
+			if (pos + 3 >= data_len) break;
 			pos += 3;
 			if ((data[pos++] & 0xF0) == 0x20)
 			{ // we need time_inc_res
@@ -681,11 +856,8 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 		unsigned int pos = 0;
 		while (pos < data_len)
 		{
-			if (memcmp(&data[pos], "\x00\x00\x01\xb2", 4))
-			{
-				pos++;
-				continue;
-			}
+			pos += find_sync(data + pos, data_len - pos, "\x00\x00\x01\xb2", 4);
+			if (pos >= data_len) break;
 			pos += 4;
 			if (data_len - pos < 13) break;
 			if (sscanf((char*)data+pos, "DivX%d%c%d%cp", &tmp1, &c1, &tmp2, &c2) == 4 && (c1 == 'b' || c1 == 'B') && (c2 == 'p' || c2 == 'P')) 
@@ -731,7 +903,13 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 				{
 					if (self->codec_type == CT_DIVX311)
 					{
-						video_write(sink, self, self->codec_data, 0, GST_BUFFER_SIZE(self->codec_data));
+						segments[segment_count++] = (write_segment_t) { self->codec_data, GST_BUFFER_DATA(self->codec_data), GST_BUFFER_SIZE(self->codec_data) };
+					}
+					else if (self->codec_type == CT_H265)
+					{
+						/* the parameter sets can be larger than the room in the PES header buffer */
+						frame_segments = gst_dvbvideosink_frame_segments(self, 1);
+						frame_segments[frame_segment_count++] = (write_segment_t) { self->codec_data, GST_BUFFER_DATA(self->codec_data), GST_BUFFER_SIZE(self->codec_data) };
 					}
 					else
 					{
@@ -742,55 +920,23 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 					self->must_send_header = FALSE;
 				}
 			}
-			if (self->codec_type == CT_H264)
+			if (self->codec_type == CT_H264 || self->codec_type == CT_H265)
 			{
-				unsigned int pos = 0;
-				if (self->h264_nal_len_size >= 3)
+				/* start codes go out between the NAL units from the class' buffer, the frame
+				 * itself is neither changed nor copied, it may well be shared */
+				GstBuffer *startcode = GST_DVBVIDEOSINK_GET_CLASS (self)->startcode;
+				int max, count;
+				frame_segments = gst_dvbvideosink_frame_segments(self, frame_segment_count);
+				max = self->frame_segments_max - frame_segment_count;
+				count = h264_nal_len_to_segments(buffer, data, data_len, self->nal_len_size, startcode, frame_segments + frame_segment_count, max);
+				if (count > max)
 				{
-					while (1)
-					{
-						unsigned int pack_len = 0;
-						int i;
-						for (i = 0; i < self->h264_nal_len_size; i++, pos++)
-						{
-							pack_len <<= 8;
-							pack_len += data[pos];
-							/* replace the lenght field with \x00..\x00\x01 */
-							data[pos] = (i == self->h264_nal_len_size - 1) ? 1 : 0;
-						}
-						if ((pos + pack_len) >= data_len) break;
-						pos += pack_len;
-					}
-				}
-				else
-				{
-					/* length field too small to insert \x00\x00\x01, so we need to copy everything into a second buffer */
-					unsigned char *dest;
-					unsigned int dest_pos = 0;
-					/* TODO: predict needed size, based on data_len and h264_nal_len_size, and number of frames */
-					tmpbuf = gst_buffer_new_and_alloc(H264_BUFFER_SIZE);
-					dest = GST_BUFFER_DATA(tmpbuf);
-					while (1)
-					{
-						unsigned int pack_len = 0;
-						int i;
-						for (i = 0; i < self->h264_nal_len_size; i++, pos++)
-						{
-							pack_len <<= 8;
-							pack_len += data[pos];
-						}
-						memcpy(dest + dest_pos, "\x00\x00\x01", 3);
-						dest_pos += 3;
-						memcpy(dest + dest_pos, data + pos, pack_len);
-						dest_pos += pack_len;
-						if ((pos + pack_len) >= data_len) break;
-						pos += pack_len;
-					}
-					/* switch to the h264 buffer, where we copied the original render buffer contents */
-					buffer = tmpbuf;
-					data = dest;
-					data_len = dest_pos;
+					GST_LOG_OBJECT (self, "%d NAL units, growing the frame segments", count / 2);
+					frame_segments = gst_dvbvideosink_frame_segments(self, frame_segment_count + count);
+					count = h264_nal_len_to_segments(buffer, data, data_len, self->nal_len_size, startcode, frame_segments + frame_segment_count, count);
 				}
+				frame_segment_count += count;
+				data_len = segments_size(frame_segments, frame_segment_count);
 			}
 			else if (self->codec_type == CT_MPEG4_PART2)
 			{
@@ -818,11 +964,8 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 		gboolean i_frame = FALSE;
 		while (pos < data_len)
 		{
-			if (memcmp(&data[pos], "\x00\x00\x01\xb6", 4))
-			{
-				pos++;
-				continue;
-			}
+			pos += find_sync(data + pos, data_len - pos, "\x00\x00\x01\xb6", 4);
+			if (pos + 4 >= data_len) break;
 			pos += 4;
 			switch ((data[pos] & 0xC0) >> 6)
 			{
@@ -950,37 +1093,35 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 				if (!memcmp(&data[pos], "\x00\x00\x01\xb5", 4))
 				{
 					// extended start code
+					size_t next;
 					pos += 3;
 					sheader_data_len += 3;
-					do
+					/* up to the next start code */
+					next = find_sync(data + pos + 1, data_len - pos - 1, "\x00\x00\x01", 3) + 1;
+					pos += next;
+					sheader_data_len += next;
+					if (pos >= data_len)
 					{
-						pos += 1;
-						++sheader_data_len;
-						if (pos + 2 > data_len)
-						{
-							ok = FALSE;
-							break;
-						}
-					} while (memcmp(&data[pos], "\x00\x00\x01", 3));
-					if (!ok) break;
+						ok = FALSE;
+						break;
+					}
 				}
 				if (pos + 3 >= data_len) break;
 				if (!memcmp(&data[pos], "\x00\x00\x01\xb2", 4))
 				{
 					// private data
+					size_t next;
 					pos += 3;
 					sheader_data_len += 3;
-					do
+					/* up to the next start code */
+					next = find_sync(data + pos + 1, data_len - pos - 1, "\x00\x00\x01", 3) + 1;
+					pos += next;
+					sheader_data_len += next;
+					if (pos >= data_len)
 					{
-						pos += 1;
-						++sheader_data_len;
-						if (pos + 2 > data_len)
-						{
-							ok = FALSE;
-							break;
-						}
-					} while (memcmp(&data[pos], "\x00\x00\x01", 3));
-					if (!ok) break;
+						ok = FALSE;
+						break;
+					}
 				}
 				self->codec_data = gst_buffer_new_and_alloc(sheader_data_len);
 				memcpy(GST_BUFFER_DATA(self->codec_data), data + pos - sheader_data_len, sheader_data_len);
@@ -991,21 +1132,17 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 		else if (self->codec_data && self->must_send_header)
 		{
 			unsigned int codec_data_len = GST_BUFFER_SIZE(self->codec_data);
-			int pos = 0;
-			while (pos < data_len)
+			/* insert the sequence header before the group start code */
+			int pos = mpeg2_find_group_start(data, data_len);
+			if (pos >= 0)
 			{
-				if (memcmp(&data[pos], "\x00\x00\x01\xb8", 4)) /* find group start code */
-				{
-					pos++;
-					continue;
-				}
-				pos -= 4; /* beginning of group start code */
 				payload_len += codec_data_len;
 				pes_set_payload_size(payload_len, pes_header);
-				if (video_write(sink, self, self->pesheader_buffer, 0, pes_header_len) < 0) goto error;
-				if (video_write(sink, self, buffer, data - GST_BUFFER_DATA(buffer), (data - GST_BUFFER_DATA(buffer)) + pos) < 0) goto error;
-				if (video_write(sink, self, self->codec_data, 0, codec_data_len) < 0) goto error;
-				if (video_write(sink, self, buffer, data - GST_BUFFER_DATA(buffer) + pos, (data - GST_BUFFER_DATA(buffer)) + data_len) < 0) goto error;
+				segments[segment_count++] = (write_segment_t) { NULL, pes_header, pes_header_len };
+				segments[segment_count++] = (write_segment_t) { buffer, data, pos };
+				segments[segment_count++] = (write_segment_t) { self->codec_data, GST_BUFFER_DATA(self->codec_data), codec_data_len };
+				segments[segment_count++] = (write_segment_t) { buffer, data + pos, data_len - pos };
+				if (write_engine_write(&self->engine, segments, segment_count) < 0) goto error;
 				self->must_send_header = FALSE;
 				return GST_FLOW_OK;
 			}
@@ -1020,14 +1157,29 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 
 	pes_set_payload_size(payload_len, pes_header);
 
-	if (video_write(sink, self, self->pesheader_buffer, 0, pes_header_len) < 0) goto error;
+	segments[segment_count++] = (write_segment_t) { NULL, pes_header, pes_header_len };
 
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 	if (commit_prev_frame_data)
 	{
-		if (video_write(sink, self, self->prev_frame, 0, GST_BUFFER_SIZE (self->prev_frame)) < 0) goto error;
+		segments[segment_count++] = (write_segment_t) { self->prev_frame, GST_BUFFER_DATA(self->prev_frame), GST_BUFFER_SIZE (self->prev_frame) };
+	}
+#endif
+	if (frame_segment_count > 0)
+	{
+		/* the frame segments come right after room for the others, so they are not copied */
+		write_segment_t *all = frame_segments - segment_count;
+		memcpy(all, segments, segment_count * sizeof(write_segment_t));
+		if (write_engine_write(&self->engine, all, segment_count + frame_segment_count) < 0) goto error;
+	}
+	else
+	{
+		segments[segment_count++] = (write_segment_t) { buffer, data, data_len };
+		if (write_engine_write(&self->engine, segments, segment_count) < 0) goto error;
 	}
 
+#ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
+	/* only release the previous frame once it has been written (or queued) */
 	if (self->prev_frame && self->prev_frame != buffer)
 	{
 		gst_buffer_unref(self->prev_frame);
@@ -1040,18 +1192,12 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 		self->prev_frame = buffer;
 	}
 #endif
-	if (video_write(sink, self, buffer, data - GST_BUFFER_DATA(buffer), (data - GST_BUFFER_DATA(buffer)) + data_len) < 0) goto error;
 
 	if (GST_BUFFER_TIMESTAMP(buffer) != GST_CLOCK_TIME_NONE)
 	{
 		self->pts_written = TRUE;
 	}
 
-	if (tmpbuf)
-	{
-		gst_buffer_unref(tmpbuf);
-		tmpbuf = NULL;
-	}
 	return GST_FLOW_OK;
 error:
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
@@ -1061,11 +1207,6 @@ error:
 		self->prev_frame = NULL;
 	}
 #endif
-	if (tmpbuf)
-	{
-		gst_buffer_unref(tmpbuf);
-		tmpbuf = NULL;
-	}
 	{
 		GST_ELEMENT_ERROR(self, RESOURCE, READ, (NULL),
 				("video write: %s", g_strerror (errno)));
@@ -1074,11 +1215,36 @@ error:
 	}
 }
 
+/* framerate in frames per 1000 seconds, rounded to the nearest the decoder knows */
+static void gst_dvbvideosink_set_fallback_framerate(GstDVBVideoSink *self, int framerate)
+{
+	static const int valid_framerates[] = { 23976, 24000, 25000, 29970, 30000, 50000, 59940, 60000 };
+	FILE *f = gst_dvbvideosink_open_fallback_framerate(self, "w");
+	int diff = G_MAXINT;
+	int best = 0;
+	unsigned int i;
+	if (!f) return;
+	for (i = 0; i < G_N_ELEMENTS(valid_framerates); ++i)
+	{
+		int ndiff = abs(framerate - valid_framerates[i]);
+		if (ndiff < diff)
+		{
+			diff = ndiff;
+			best = i;
+		}
+	}
+	GST_DEBUG_OBJECT (self, "fallback framerate %d", valid_framerates[best]);
+	fprintf(f, "%d", valid_framerates[best]);
+	fclose(f);
+}
+
 static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (basesink);
 	GstStructure *structure = gst_caps_get_structure (caps, 0);
 	const char *mimetype = gst_structure_get_name (structure);
+	/* the frame rate of the stream itself, in frames per 1000 seconds */
+	int stream_framerate = 0;
 	self->stream_type = STREAMTYPE_UNKNOWN;
 
 	GST_INFO_OBJECT (self, "caps = %" GST_PTR_FORMAT, caps);
@@ -1156,30 +1322,30 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 				unsigned short len = (data[6] << 8) | data[7];
 				if (cd_len >= (len + 8))
 				{
-					unsigned int i=0;
-					uint8_t profile_num[] = { 66, 77, 88, 100 };
-					uint8_t profile_cmp[2] = { 0x67, 0x00 };
-					const char *profile_str[] = { "baseline", "main", "extended", "high" };
+					struct h264_sps sps;
 					memcpy(tmp, "\x00\x00\x00\x01", 4);
 					tmp_len += 4;
 					memcpy(tmp + tmp_len, data + 8, len);
-					for (i = 0; i < 4; ++i)
+					if (h264_parse_sps(data + 8, len, &sps))
 					{
-						profile_cmp[1] = profile_num[i];
-						if (!memcmp(tmp+tmp_len, profile_cmp, 2))
+						GST_INFO_OBJECT (self, "H264 profile %d@%d.%d %dx%d, %d reorder frames", sps.profile_idc, sps.level_idc / 10, sps.level_idc % 10, sps.width, sps.height, sps.max_num_reorder_frames);
+						/* our decoders refuse levels above 4.1, so streams whose
+						 * frames fit 4.1 but claim more get their level patched.
+						 * The level byte is never subject to emulation prevention */
+						if (sps.level_idc > 41 && sps.width_mbs * sps.height_mbs <= H264_LEVEL_41_MAX_FS)
 						{
-							uint8_t level_org = tmp[tmp_len + 3];
-							if (level_org > 0x29)
-							{
-								GST_INFO_OBJECT (self, "H264 %s profile@%d.%d patched down to 4.1!", profile_str[i], level_org / 10 , level_org % 10);
-								tmp[tmp_len+3] = 0x29; // level 4.1
-							}
-							else
-							{
-								GST_INFO_OBJECT (self, "H264 %s profile@%d.%d", profile_str[i], level_org / 10 , level_org % 10);
-							}
-							break;
+							GST_INFO_OBJECT (self, "H264 level %d.%d patched down to 4.1!", sps.level_idc / 10, sps.level_idc % 10);
+							tmp[tmp_len + 3] = 41;
+						}
+						else if (sps.level_idc > 41)
+						{
+							GST_WARNING_OBJECT (self, "H264 frame size exceeds level 4.1, not patching the level");
 						}
+						stream_framerate = h264_sps_framerate(&sps);
+					}
+					else
+					{
+						GST_WARNING_OBJECT (self, "H264 codec data without a valid SPS");
 					}
 					tmp_len += len;
 					cd_pos = 8 + len;
@@ -1195,7 +1361,7 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 							tmp_len += len;
 							self->codec_data = gst_buffer_new_and_alloc(tmp_len);
 							memcpy(GST_BUFFER_DATA(self->codec_data), tmp, tmp_len);
-							self->h264_nal_len_size = (data[4] & 0x03) + 1;
+							self->nal_len_size = (data[4] & 0x03) + 1;
 						}
 						else
 						{
@@ -1223,10 +1389,41 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 		}
 		else
 		{
-			self->h264_nal_len_size = 0;
+			self->nal_len_size = 0;
 		}
 		GST_INFO_OBJECT (self, "MIMETYPE video/x-h264 -> STREAMTYPE_MPEG4_H264");
 	}
+	else if (!strcmp (mimetype, "video/x-h265"))
+	{
+		const GValue *cd_data = gst_structure_get_value(structure, "codec_data");
+		self->stream_type = STREAMTYPE_H265_HEVC;
+		self->codec_type = CT_H265;
+		/* without codec_data, the stream has start codes already */
+		self->nal_len_size = 0;
+		if (cd_data)
+		{
+			GstBuffer *codec_data = gst_value_get_buffer(cd_data);
+			GstBuffer *parameter_sets = gst_buffer_new_and_alloc(2 * GST_BUFFER_SIZE (codec_data));
+			size_t len;
+			int nal_len_size;
+			GST_INFO_OBJECT (self, "H265 have codec data..!");
+			if (h265_hvcc_to_startcode(GST_BUFFER_DATA (codec_data), GST_BUFFER_SIZE (codec_data), GST_BUFFER_DATA (parameter_sets), &len, &nal_len_size))
+			{
+				/* sent before the first frame, even when empty, as the frames need converting anyway */
+				GST_BUFFER_SIZE (parameter_sets) = len;
+				self->codec_data = parameter_sets;
+				self->nal_len_size = nal_len_size;
+			}
+			else
+			{
+				/* the frames are length prefixed, the decoder can't take them as they are */
+				gst_buffer_unref(parameter_sets);
+				GST_ELEMENT_ERROR (self, STREAM, FORMAT, (NULL), ("malformed hvcC codec_data"));
+				return FALSE;
+			}
+		}
+		GST_INFO_OBJECT (self, "MIMETYPE video/x-h265 -> STREAMTYPE_H265_HEVC");
+	}
 	else if (!strcmp (mimetype, "video/x-h263"))
 	{
 		self->stream_type = STREAMTYPE_H263;
@@ -1329,39 +1526,29 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 	if (self->stream_type != STREAMTYPE_UNKNOWN)
 	{
 		gint numerator, denominator;
-		if (gst_structure_get_fraction (structure, "framerate", &numerator, &denominator))
+		/* the VUI timing of the stream is more to be trusted than the caps */
+		if (stream_framerate)
 		{
-			FILE *f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "w");
-			if (f)
-			{
-				int valid_framerates[] = { 23976, 24000, 25000, 29970, 30000, 50000, 59940, 60000 };
-				int framerate = (int)(((double)numerator * 1000) / denominator);
-				int diff = 60000;
-				int best = 0;
-				int i = 0;
-				for (; i < 7; ++i)
-				{
-					int ndiff = abs(framerate - valid_framerates[i]);
-					if (ndiff < diff)
-					{
-						diff = ndiff;
-						best = i;
-					}
-				}
-				fprintf(f, "%d", valid_framerates[best]);
-				fclose(f);
-			}
+			gst_dvbvideosink_set_fallback_framerate(self, stream_framerate);
+		}
+		else if (gst_structure_get_fraction (structure, "framerate", &numerator, &denominator) && denominator)
+		{
+			gst_dvbvideosink_set_fallback_framerate(self, (int)(((double)numerator * 1000) / denominator));
 		}
 		if (self->playing)
 		{
-			if (self->fd >= 0) ioctl(self->fd, VIDEO_STOP, 0);
+			if (self->engine.fd >= 0) device_ioctl(&self->device, VIDEO_STOP, 0);
 			self->playing = FALSE;
 		}
-		if (self->fd < 0 || ioctl(self->fd, VIDEO_SET_STREAMTYPE, self->stream_type) < 0)
+		if (self->engine.fd >= 0 && self->device.stream_type == self->stream_type)
+		{
+			GST_DEBUG_OBJECT(self, "decoder already set to streamtype %i", self->stream_type);
+		}
+		else if (self->engine.fd < 0 || device_ioctl(&self->device, VIDEO_SET_STREAMTYPE, self->stream_type) < 0)
 		{
 			GST_ELEMENT_ERROR(self, STREAM, CODEC_NOT_FOUND, (NULL), ("hardware decoder can't handle streamtype %i", self->stream_type));
 		}
-		if (self->fd >= 0) 
+		if (self->engine.fd >= 0) 
 		{
 			if (self->codec_type == CT_VC1)
 			{
@@ -1376,7 +1563,7 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 					memset(data, 0, videocodecdata.length);
 					data += 8;
 					memcpy(data, GST_BUFFER_DATA(gst_value_get_buffer(codec_data)), codec_size);
-					ioctl(self->fd, VIDEO_SET_CODEC_DATA, &videocodecdata);
+					device_ioctl(&self->device, VIDEO_SET_CODEC_DATA, (unsigned long)&videocodecdata);
 					g_free(videocodecdata.data);
 				}
 			}
@@ -1403,11 +1590,11 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 					*(data++) = (height >> 8) & 0xff;
 					*(data++) = height & 0xff;
 					if (codec_data && codec_size) memcpy(data, GST_BUFFER_DATA(gst_value_get_buffer(codec_data)), codec_size);
-					ioctl(self->fd, VIDEO_SET_CODEC_DATA, &videocodecdata);
+					device_ioctl(&self->device, VIDEO_SET_CODEC_DATA, (unsigned long)&videocodecdata);
 					g_free(videocodecdata.data);
 				}
 			}
-			ioctl(self->fd, VIDEO_PLAY);
+			device_ioctl(&self->device, VIDEO_PLAY, 0);
 		}
 		self->playing = TRUE;
 	}
@@ -1423,21 +1610,15 @@ static gboolean gst_dvbvideosink_start(GstBaseSink *basesink)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK(basesink);
 	FILE *f = NULL;
+	gchar *device_path, *capture_path;
 
 	GST_DEBUG_OBJECT(self, "start");
 
-	if (socketpair(PF_UNIX, SOCK_STREAM, 0, self->unlockfd) < 0)
-	{
-		perror("socketpair");
-		goto error;
-	}
-
-	fcntl(self->unlockfd[0], F_SETFL, O_NONBLOCK);
-	fcntl(self->unlockfd[1], F_SETFL, O_NONBLOCK);
+	if (write_engine_start(&self->engine) < 0) goto error;
 
 	self->pesheader_buffer = gst_buffer_new_and_alloc(2048);
 
-	f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "r");
+	f = gst_dvbvideosink_open_fallback_framerate(self, "r");
 	if (f)
 	{
 		fgets(self->saved_fallback_framerate, sizeof(self->saved_fallback_framerate), f);
@@ -1445,7 +1626,22 @@ static gboolean gst_dvbvideosink_start(GstBaseSink *basesink)
 		f = NULL;
 	}
 
-	self->fd = open("/dev/dvb/adapter0/video0", O_RDWR | O_NONBLOCK);
+	GST_OBJECT_LOCK(self);
+	device_path = self->device_path ? g_strdup(self->device_path) : device_dvb_path("video", self->adapter, self->decoder_index);
+	self->engine.fd = device_open(&self->device, self->backend, device_path);
+	g_free(device_path);
+	capture_path = g_strdup(self->capture_path);
+	GST_OBJECT_UNLOCK(self);
+
+	if (capture_path)
+	{
+		self->engine.capture = self->device.capture = capture_open(capture_path);
+		if (!self->engine.capture)
+		{
+			GST_ELEMENT_WARNING(self, RESOURCE, OPEN_WRITE, (NULL), ("could not create capture %s: %s", capture_path, g_strerror(errno)));
+		}
+		g_free(capture_path);
+	}
 
 	self->pts_written = FALSE;
 	self->lastpts = 0;
@@ -1464,24 +1660,38 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK(basesink);
 	FILE *f = NULL;
 	GST_DEBUG_OBJECT(self, "stop");
-	if (self->fd >= 0)
+	/* stop the writer thread before the device is closed */
+	write_engine_stop(&self->engine);
+	if (self->engine.fd >= 0)
 	{
 		if (self->playing)
 		{
-			ioctl(self->fd, VIDEO_STOP);
+			device_ioctl(&self->device, VIDEO_STOP, 0);
 			self->playing = FALSE;
 		}
 		if (self->rate != 1.0)
 		{
-			ioctl(self->fd, VIDEO_SLOWMOTION, 0);
-			ioctl(self->fd, VIDEO_FAST_FORWARD, 0);
+			device_ioctl(&self->device, VIDEO_SLOWMOTION, 0);
+			device_ioctl(&self->device, VIDEO_FAST_FORWARD, 0);
 			self->rate = 1.0;
 		}
-		ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
-		close(self->fd);
-		self->fd = -1;
+		if (self->keep_alive)
+		{
+			/* stays in memory source mode, with the streamtype set, until taken over, released or timed out */
+			device_ioctl(&self->device, VIDEO_CLEAR_BUFFER, 0);
+			device_park(&self->device, self->keep_alive_timeout, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
+		}
+		else
+		{
+			device_ioctl(&self->device, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
+			device_close(&self->device);
+		}
+		self->engine.fd = -1;
 	}
 
+	capture_close(self->engine.capture);
+	self->engine.capture = self->device.capture = NULL;
+
 	if (self->codec_data)
 	{
 		gst_buffer_unref(self->codec_data);
@@ -1502,12 +1712,7 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 	}
 #endif
 
-	while (self->queue)
-	{
-		queue_pop(&self->queue);
-	}
-
-	f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "w");
+	f = gst_dvbvideosink_open_fallback_framerate(self, "w");
 	if (f)
 	{
 		fputs(self->saved_fallback_framerate, f);
@@ -1515,17 +1720,6 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 		f = NULL;
 	}
 
-	/* close write end first */
-	if (self->unlockfd[1] >= 0)
-	{
-		close(self->unlockfd[1]);
-		self->unlockfd[1] = -1;
-	}
-	if (self->unlockfd[0] >= 0)
-	{
-		close(self->unlockfd[0]);
-		self->unlockfd[0] = -1;
-	}
 	return TRUE;
 }
 
@@ -1541,17 +1735,17 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 		break;
 	case GST_STATE_CHANGE_READY_TO_PAUSED:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_READY_TO_PAUSED");
-		self->paused = TRUE;
-		if (self->fd >= 0)
+		write_engine_set_paused(&self->engine, TRUE);
+		if (self->engine.fd >= 0)
 		{
-			ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_MEMORY);
-			ioctl(self->fd, VIDEO_FREEZE);
+			device_ioctl(&self->device, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_MEMORY);
+			device_ioctl(&self->device, VIDEO_FREEZE, 0);
 		}
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_PLAYING");
-		if (self->fd >= 0) ioctl(self->fd, VIDEO_CONTINUE);
-		self->paused = FALSE;
+		if (self->engine.fd >= 0) device_ioctl(&self->device, VIDEO_CONTINUE, 0);
+		write_engine_set_paused(&self->engine, FALSE);
 		break;
 	default:
 		break;
@@ -1563,10 +1757,8 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 	{
 	case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PLAYING_TO_PAUSED");
-		self->paused = TRUE;
-		if (self->fd >= 0) ioctl(self->fd, VIDEO_FREEZE);
-		/* wakeup the poll */
-		write(self->unlockfd[1], "\x01", 1);
+		write_engine_set_paused(&self->engine, TRUE);
+		if (self->engine.fd >= 0) device_ioctl(&self->device, VIDEO_FREEZE, 0);
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_DEBUG_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_READY");
@@ -1580,34 +1772,3 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 
 	return ret;
 }
-
-/* entry point to initialize the plug-in
- * initialize the plug-in itself
- * register the element factories and pad templates
- * register the features
- *
- * exchange the string 'plugin' with your elemnt name
- */
-static gboolean plugin_init (GstPlugin *plugin)
-{
-	return gst_element_register (plugin, "dvbvideosink",
-						 GST_RANK_PRIMARY,
-						 GST_TYPE_DVBVIDEOSINK);
-}
-
-/* this is the structure that gstreamer looks for to register plugins
- *
- * exchange the strings 'plugin' and 'Template plugin' with you plugin name and
- * description
- */
-GST_PLUGIN_DEFINE (
-	GST_VERSION_MAJOR,
-	GST_VERSION_MINOR,
-	"dvb_video_out",
-	"DVB Video Output",
-	plugin_init,
-	VERSION,
-	"LGPL",
-	"GStreamer",
-	"http://gstreamer.net/"
-)
@@ -56,6 +56,8 @@ G_BEGIN_DECLS
   (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_DVBVIDEOSINK,GstDVBVideoSink))
 #define GST_DVBVIDEOSINK_CLASS(klass) \
   (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_DVBVIDEOSINK,GstDVBVideoSinkClass))
+#define GST_DVBVIDEOSINK_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj),GST_TYPE_DVBVIDEOSINK,GstDVBVideoSinkClass))
 #define GST_IS_DVBVIDEOSINK(obj) \
   (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_DVBVIDEOSINK))
 #define GST_IS_DVBVIDEOSINK_CLASS(klass) \
@@ -65,7 +67,7 @@ typedef struct _GstDVBVideoSink		GstDVBVideoSink;
 typedef struct _GstDVBVideoSinkClass	GstDVBVideoSinkClass;
 typedef struct _GstDVBVideoSinkPrivate	GstDVBVideoSinkPrivate;
 
-typedef enum { CT_MPEG1, CT_MPEG2, CT_H264, CT_DIVX311, CT_DIVX4, CT_MPEG4_PART2, CT_VC1, CT_VC1_SM } t_codec_type;
+typedef enum { CT_MPEG1, CT_MPEG2, CT_H264, CT_DIVX311, CT_DIVX4, CT_MPEG4_PART2, CT_VC1, CT_VC1_SM, CT_H265 } t_codec_type;
 typedef enum {
 	STREAMTYPE_UNKNOWN = -1,
 	STREAMTYPE_MPEG2 = 0,
@@ -75,6 +77,7 @@ typedef enum {
 	STREAMTYPE_MPEG4_Part2 = 4,
 	STREAMTYPE_VC1_SM = 5,
 	STREAMTYPE_MPEG1 = 6,
+	STREAMTYPE_H265_HEVC = 7,
 	STREAMTYPE_XVID = 10,
 	STREAMTYPE_DIVX311 = 13,
 	STREAMTYPE_DIVX4 = 14,
@@ -85,12 +88,22 @@ struct _GstDVBVideoSink
 {
 	GstBaseSink element;
 
-	int fd;
-	int unlockfd[2];
+	write_engine_t engine;
+	device_t device;
+	device_backend_t backend;
+	guint adapter, decoder_index;
+	gchar *device_path;
+	gchar *capture_path;
+	gboolean keep_alive;
+	guint keep_alive_timeout;
 
-	gint h264_nal_len_size;
+	gint nal_len_size;
 
 	GstBuffer *pesheader_buffer;
+	/* AVCC and hvcC frames as start codes and NAL units, after room for the
+	 * segments going out before them, grown to the most NAL units seen */
+	write_segment_t *frame_segments;
+	int frame_segments_max;
 
 	GstBuffer *codec_data;
 	t_codec_type codec_type;
@@ -106,19 +119,21 @@ struct _GstDVBVideoSink
 	char saved_fallback_framerate[16];
 
 	gdouble rate;
-	gboolean playing, paused, flushing, unlocking;
+	gboolean playing;
 	gboolean pts_written;
 	gint64 lastpts;
 	gint64 timestamp_offset;
 	gboolean must_send_header;
-
-	queue_entry_t *queue;
 };
 
 struct _GstDVBVideoSinkClass 
 {
   GstBaseSinkClass parent_class;
   gint64 (*get_decoder_time) (GstDVBVideoSink *sink);
+  void (*release_parked) (GstDVBVideoSink *sink);
+
+  /* the start codes put between the NAL units of AVCC frames */
+  GstBuffer *startcode;
 };
 
 GType gst_dvbvideosink_get_type (void);
@@ -0,0 +1,509 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include <gst/gst.h>
+
+#include "common.h"
+#include "parse.h"
+
+void bitstream_init(struct bitstream *bit, const void *buffer, gboolean wr)
+{
+	bit->data = (guint8*) buffer;
+	if (wr) {
+		bit->avail = 0;
+		bit->last = 0;
+	}
+	else {
+		bit->avail = 8;
+		bit->last = *bit->data++;
+	}
+}
+
+unsigned long bitstream_get(struct bitstream *bit, int bits)
+{
+	unsigned long res = 0;
+	while (bits)
+	{
+		unsigned int d = bits;
+		if (!bit->avail)
+		{
+			bit->last = *bit->data++;
+			bit->avail = 8;
+		}
+		if (d > bit->avail)
+			d=bit->avail;
+		res<<=d;
+		res|=(bit->last>>(bit->avail-d))&~(-1<<d);
+		bit->avail -= d;
+		bits -= d;
+	}
+	return res;
+}
+
+void bitstream_put(struct bitstream *bit, unsigned long val, int bits)
+{
+	while (bits)
+	{
+		bit->last |= ((val & (1 << (bits-1))) ? 1 : 0) << (7 - bit->avail);
+		if (++bit->avail == 8)
+		{
+			*bit->data = bit->last;
+			++bit->data;
+			bit->last = 0;
+			bit->avail = 0;
+		}
+		--bits;
+	}
+}
+
+static const guint8 h264_startcode[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+/* a buffer around the 4 byte start code, for h264_nal_len_to_segments, so
+ * queueing the start codes takes a reference instead of a copy */
+GstBuffer *h264_startcode_buffer_new(void)
+{
+	GstBuffer *buffer = gst_buffer_new();
+	GST_BUFFER_DATA(buffer) = (guint8*)h264_startcode;
+	GST_BUFFER_SIZE(buffer) = sizeof(h264_startcode);
+	return buffer;
+}
+
+/* describe the AVCC NAL units in data (which is in buffer) as segments,
+ * which works just as well for HEVC, framed the same way in hvcC streams,
+ * with start codes from startcode between them, without touching data.
+ * The start codes are 4 bytes for 4 byte length fields and 3 bytes otherwise,
+ * so the result is the same as from replacing the length fields. A length running
+ * past the end of data is cut short. Returns the number of segments needed,
+ * only the first max of them are filled in */
+int h264_nal_len_to_segments(GstBuffer *buffer, const unsigned char *data, size_t len, int nal_len_size, GstBuffer *startcode, write_segment_t *segments, int max)
+{
+	const guint8 *code = GST_BUFFER_DATA(startcode);
+	size_t code_len = nal_len_size == 4 ? 4 : 3;
+	size_t pos = 0;
+	int count = 0;
+
+	code += 4 - code_len;
+	while (pos + nal_len_size <= len)
+	{
+		size_t nal_len = 0;
+		int i;
+		for (i = 0; i < nal_len_size; i++, pos++)
+		{
+			nal_len = (nal_len << 8) | data[pos];
+		}
+		if (nal_len > len - pos) nal_len = len - pos;
+		if (!nal_len) continue;
+		if (count + 2 <= max)
+		{
+			segments[count] = (write_segment_t) { startcode, code, code_len };
+			segments[count + 1] = (write_segment_t) { buffer, data + pos, nal_len };
+		}
+		count += 2;
+		pos += nal_len;
+	}
+	return count;
+}
+
+/* the parameter sets (and SEI) of an HEVC decoder configuration record
+ * (hvcC) as NAL units with 4 byte start codes in dest, which needs room
+ * for twice len. Sets dest_len to the number of bytes in dest, and
+ * nal_len_size to the size of the length fields in the frames.
+ * Returns FALSE when hvcc is malformed */
+gboolean h265_hvcc_to_startcode(const unsigned char *hvcc, size_t len, unsigned char *dest, size_t *dest_len, int *nal_len_size)
+{
+	size_t pos = 23;
+	int arrays, i;
+
+	*dest_len = 0;
+	if (len < 23 || hvcc[0] != 1) return FALSE;
+	*nal_len_size = (hvcc[21] & 0x03) + 1;
+	arrays = hvcc[22];
+	for (i = 0; i < arrays; i++)
+	{
+		int nalus, j;
+		if (pos + 3 > len) return FALSE;
+		/* completeness and NAL unit type, then the number of NAL units */
+		nalus = (hvcc[pos + 1] << 8) | hvcc[pos + 2];
+		pos += 3;
+		for (j = 0; j < nalus; j++)
+		{
+			size_t nal_len;
+			if (pos + 2 > len) return FALSE;
+			nal_len = (hvcc[pos] << 8) | hvcc[pos + 1];
+			pos += 2;
+			if (nal_len > len - pos) return FALSE;
+			memcpy(dest + *dest_len, "\x00\x00\x00\x01", 4);
+			memcpy(dest + *dest_len + 4, hvcc + pos, nal_len);
+			*dest_len += 4 + nal_len;
+			pos += nal_len;
+		}
+	}
+	return TRUE;
+}
+
+/* an exp-Golomb reader on the RBSP of a NAL unit, dropping the emulation
+ * prevention bytes as it goes. Reading past the end yields zeros and sets
+ * overrun, so the parsers check once at the end */
+struct rbsp_reader
+{
+	const unsigned char *data, *end;
+	int zeros;
+	guint8 last;
+	int avail;
+	gboolean overrun;
+};
+
+static void rbsp_reader_init(struct rbsp_reader *rd, const unsigned char *data, size_t len)
+{
+	rd->data = data;
+	rd->end = data + len;
+	rd->zeros = 0;
+	rd->last = 0;
+	rd->avail = 0;
+	rd->overrun = FALSE;
+}
+
+static guint32 rbsp_get(struct rbsp_reader *rd, int bits)
+{
+	guint32 res = 0;
+	while (bits--)
+	{
+		if (!rd->avail)
+		{
+			if (rd->data < rd->end && rd->zeros >= 2 && *rd->data == 3)
+			{
+				rd->zeros = 0;
+				rd->data++;
+			}
+			if (rd->data >= rd->end)
+			{
+				rd->overrun = TRUE;
+				return 0;
+			}
+			rd->last = *rd->data++;
+			rd->zeros = rd->last ? 0 : rd->zeros + 1;
+			rd->avail = 8;
+		}
+		res = (res << 1) | ((rd->last >> --rd->avail) & 1);
+	}
+	return res;
+}
+
+static guint32 rbsp_get_ue(struct rbsp_reader *rd)
+{
+	int zeros = 0;
+	while (!rbsp_get(rd, 1))
+	{
+		if (rd->overrun || ++zeros > 31)
+		{
+			rd->overrun = TRUE;
+			return 0;
+		}
+	}
+	return ((1U << zeros) - 1) + rbsp_get(rd, zeros);
+}
+
+static gint32 rbsp_get_se(struct rbsp_reader *rd)
+{
+	guint32 k = rbsp_get_ue(rd);
+	return (k & 1) ? (gint32)((k + 1) / 2) : -(gint32)(k / 2);
+}
+
+static void h264_skip_scaling_list(struct rbsp_reader *rd, int size)
+{
+	int last = 8, next = 8, i;
+	for (i = 0; i < size && !rd->overrun; i++)
+	{
+		if (next) next = (last + rbsp_get_se(rd) + 256) % 256;
+		if (next) last = next;
+	}
+}
+
+static void h264_skip_hrd_parameters(struct rbsp_reader *rd)
+{
+	guint32 cpb_cnt = rbsp_get_ue(rd) + 1, i;
+	if (cpb_cnt > 32)
+	{
+		rd->overrun = TRUE;
+		return;
+	}
+	/* bit_rate_scale, cpb_size_scale */
+	rbsp_get(rd, 8);
+	for (i = 0; i < cpb_cnt; i++)
+	{
+		rbsp_get_ue(rd);
+		rbsp_get_ue(rd);
+		rbsp_get(rd, 1);
+	}
+	/* the removal, output delay and time offset lengths */
+	rbsp_get(rd, 20);
+}
+
+/* parse the SPS NAL unit nal (starting with the NAL header, without start
+ * code or length field) into sps. Returns FALSE when it isn't an SPS or is
+ * truncated */
+gboolean h264_parse_sps(const unsigned char *nal, size_t len, struct h264_sps *sps)
+{
+	struct rbsp_reader rd;
+	int chroma_format_idc = 1, separate_colour_plane = 0;
+	int crop_unit_x, crop_unit_y;
+	guint32 width_mbs, height_map_units, poc_type;
+
+	memset(sps, 0, sizeof(*sps));
+	sps->max_num_reorder_frames = -1;
+	if (len < 4 || (nal[0] & 0x1f) != 7) return FALSE;
+	rbsp_reader_init(&rd, nal + 1, len - 1);
+
+	sps->profile_idc = rbsp_get(&rd, 8);
+	sps->constraint_flags = rbsp_get(&rd, 8);
+	sps->level_idc = rbsp_get(&rd, 8);
+	rbsp_get_ue(&rd);
+	switch (sps->profile_idc)
+	{
+	case 100: case 110: case 122: case 244: case 44:
+	case 83: case 86: case 118: case 128: case 138:
+	case 139: case 134: case 135:
+		chroma_format_idc = rbsp_get_ue(&rd);
+		if (chroma_format_idc > 3) return FALSE;
+		if (chroma_format_idc == 3) separate_colour_plane = rbsp_get(&rd, 1);
+		/* bit depths, qpprime_y_zero_transform_bypass */
+		rbsp_get_ue(&rd);
+		rbsp_get_ue(&rd);
+		rbsp_get(&rd, 1);
+		if (rbsp_get(&rd, 1))
+		{
+			int i, lists = chroma_format_idc == 3 ? 12 : 8;
+			for (i = 0; i < lists; i++)
+			{
+				if (rbsp_get(&rd, 1)) h264_skip_scaling_list(&rd, i < 6 ? 16 : 64);
+			}
+		}
+		break;
+	}
+	/* log2_max_frame_num */
+	rbsp_get_ue(&rd);
+	poc_type = rbsp_get_ue(&rd);
+	if (poc_type == 0)
+	{
+		rbsp_get_ue(&rd);
+	}
+	else if (poc_type == 1)
+	{
+		guint32 cycle, i;
+		rbsp_get(&rd, 1);
+		rbsp_get_se(&rd);
+		rbsp_get_se(&rd);
+		cycle = rbsp_get_ue(&rd);
+		if (cycle > 255) return FALSE;
+		for (i = 0; i < cycle; i++) rbsp_get_se(&rd);
+	}
+	/* max_num_ref_frames, gaps_in_frame_num_allowed */
+	rbsp_get_ue(&rd);
+	rbsp_get(&rd, 1);
+	width_mbs = rbsp_get_ue(&rd) + 1;
+	height_map_units = rbsp_get_ue(&rd) + 1;
+	sps->frame_mbs_only = rbsp_get(&rd, 1);
+	if (!sps->frame_mbs_only) rbsp_get(&rd, 1);
+	/* direct_8x8_inference */
+	rbsp_get(&rd, 1);
+	if (rbsp_get(&rd, 1))
+	{
+		sps->crop_left = rbsp_get_ue(&rd);
+		sps->crop_right = rbsp_get_ue(&rd);
+		sps->crop_top = rbsp_get_ue(&rd);
+		sps->crop_bottom = rbsp_get_ue(&rd);
+	}
+	if (rd.overrun || width_mbs > 1024 || height_map_units > 1024) return FALSE;
+
+	sps->width_mbs = width_mbs;
+	sps->height_mbs = height_map_units * (2 - sps->frame_mbs_only);
+	if (separate_colour_plane || !chroma_format_idc)
+	{
+		crop_unit_x = 1;
+		crop_unit_y = 2 - sps->frame_mbs_only;
+	}
+	else
+	{
+		crop_unit_x = chroma_format_idc == 3 ? 1 : 2;
+		crop_unit_y = (chroma_format_idc == 1 ? 2 : 1) * (2 - sps->frame_mbs_only);
+	}
+	sps->width = sps->width_mbs * 16 - crop_unit_x * (sps->crop_left + sps->crop_right);
+	sps->height = sps->height_mbs * 16 - crop_unit_y * (sps->crop_top + sps->crop_bottom);
+	if (sps->width <= 0 || sps->height <= 0) return FALSE;
+
+	if (rbsp_get(&rd, 1))
+	{
+		gboolean nal_hrd, vcl_hrd;
+		/* aspect_ratio_info */
+		if (rbsp_get(&rd, 1) && rbsp_get(&rd, 8) == 255) rbsp_get(&rd, 32);
+		/* overscan_info */
+		if (rbsp_get(&rd, 1)) rbsp_get(&rd, 1);
+		/* video_signal_type, with colour_description */
+		if (rbsp_get(&rd, 1))
+		{
+			rbsp_get(&rd, 4);
+			if (rbsp_get(&rd, 1)) rbsp_get(&rd, 24);
+		}
+		/* chroma_loc_info */
+		if (rbsp_get(&rd, 1))
+		{
+			rbsp_get_ue(&rd);
+			rbsp_get_ue(&rd);
+		}
+		sps->timing_info_present = rbsp_get(&rd, 1);
+		if (sps->timing_info_present)
+		{
+			sps->num_units_in_tick = rbsp_get(&rd, 32);
+			sps->time_scale = rbsp_get(&rd, 32);
+			sps->fixed_frame_rate = rbsp_get(&rd, 1);
+		}
+		nal_hrd = rbsp_get(&rd, 1);
+		if (nal_hrd) h264_skip_hrd_parameters(&rd);
+		vcl_hrd = rbsp_get(&rd, 1);
+		if (vcl_hrd) h264_skip_hrd_parameters(&rd);
+		/* low_delay_hrd, then pic_struct_present */
+		if (nal_hrd || vcl_hrd) rbsp_get(&rd, 1);
+		rbsp_get(&rd, 1);
+		if (rbsp_get(&rd, 1))
+		{
+			/* motion_vectors_over_pic_boundaries, max_bytes_per_pic_denom,
+			 * max_bits_per_mb_denom, log2_max_mv_length_horizontal/vertical */
+			rbsp_get(&rd, 1);
+			rbsp_get_ue(&rd);
+			rbsp_get_ue(&rd);
+			rbsp_get_ue(&rd);
+			rbsp_get_ue(&rd);
+			sps->max_num_reorder_frames = rbsp_get_ue(&rd);
+			sps->max_dec_frame_buffering = rbsp_get_ue(&rd);
+		}
+		/* a broken VUI leaves what was parsed before it */
+		if (rd.overrun)
+		{
+			sps->timing_info_present = FALSE;
+			sps->max_num_reorder_frames = -1;
+			sps->max_dec_frame_buffering = 0;
+		}
+	}
+	return TRUE;
+}
+
+/* the frame rate the VUI timing of sps gives, in frames per 1000 seconds,
+ * or 0 when there is none */
+int h264_sps_framerate(const struct h264_sps *sps)
+{
+	if (!sps->timing_info_present || !sps->num_units_in_tick || !sps->time_scale) return 0;
+	/* a tick is a field, two to the frame */
+	return (int)((guint64)sps->time_scale * 1000 / (2 * (guint64)sps->num_units_in_tick));
+}
+
+static inline gboolean sync_at(const unsigned char *data, const unsigned char *pattern, int pattern_len)
+{
+	return data[0] == pattern[0] && !memcmp(data + 1, pattern + 1, pattern_len - 1);
+}
+
+/*
+ * offset of the first occurrence of the 3 or 4 byte pattern (a start code,
+ * or a sync word) in data, or len if there is none.
+ * Compares 16 positions at a time with SSE2 or NEON, otherwise skips a word
+ * at a time as long as the word doesn't contain the first byte of the pattern
+ */
+size_t find_sync(const unsigned char *data, size_t len, const void *pattern, int pattern_len)
+{
+	const unsigned char *p = pattern;
+	size_t pos = 0;
+
+#if defined(__SSE2__)
+	const __m128i b0 = _mm_set1_epi8(p[0]), b1 = _mm_set1_epi8(p[1]), b2 = _mm_set1_epi8(p[2]);
+	const __m128i b3 = _mm_set1_epi8(p[pattern_len - 1]);
+	while (pos + 16 + pattern_len - 1 <= len)
+	{
+		const unsigned char *d = data + pos;
+		__m128i m = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)d), b0),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(d + 1)), b1));
+		int mask;
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(d + 2)), b2));
+		if (pattern_len == 4) m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(d + 3)), b3));
+		mask = _mm_movemask_epi8(m);
+		if (mask) return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const uint8x16_t b0 = vdupq_n_u8(p[0]), b1 = vdupq_n_u8(p[1]), b2 = vdupq_n_u8(p[2]);
+	const uint8x16_t b3 = vdupq_n_u8(p[pattern_len - 1]);
+	while (pos + 16 + pattern_len - 1 <= len)
+	{
+		const unsigned char *d = data + pos;
+		uint8x16_t m = vandq_u8(vceqq_u8(vld1q_u8(d), b0), vceqq_u8(vld1q_u8(d + 1), b1));
+		uint64x2_t any;
+		m = vandq_u8(m, vceqq_u8(vld1q_u8(d + 2), b2));
+		if (pattern_len == 4) m = vandq_u8(m, vceqq_u8(vld1q_u8(d + 3), b3));
+		any = vreinterpretq_u64_u8(m);
+		if (vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1))
+		{
+			/* there is no cheap movemask, the match is among these 16 */
+			size_t end = pos + 16;
+			for (; pos < end; pos++)
+			{
+				if (sync_at(data + pos, p, pattern_len)) return pos;
+			}
+		}
+		pos += 16;
+	}
+#else
+	const unsigned long ones = ~0UL / 0xff, highs = ones * 0x80, first = ones * p[0];
+	while (pos + sizeof(unsigned long) + pattern_len - 1 <= len)
+	{
+		unsigned long v;
+		memcpy(&v, data + pos, sizeof(v));
+		v ^= first;
+		/* a zero byte in v is a byte equal to the first one of the pattern */
+		if ((v - ones) & ~v & highs)
+		{
+			size_t end = pos + sizeof(v);
+			for (; pos < end; pos++)
+			{
+				if (sync_at(data + pos, p, pattern_len)) return pos;
+			}
+			continue;
+		}
+		pos += sizeof(v);
+	}
+#endif
+	for (; pos + pattern_len <= len; pos++)
+	{
+		if (sync_at(data + pos, p, pattern_len)) return pos;
+	}
+	return len;
+}
+
+/* offset of the first group start code in data, or -1 */
+int mpeg2_find_group_start(const unsigned char *data, size_t len)
+{
+	size_t pos = find_sync(data, len, "\x00\x00\x01\xb8", 4);
+	return pos < len ? (int)pos : -1;
+}
+
+/* offset of the DTS-HD extension in a DTS frame, len if there is none */
+size_t dts_find_hd_sync(const unsigned char *data, size_t len)
+{
+	return find_sync(data, len, "\x64\x58\x20\x25", 4);
+}
+
+/* offset of the next 4 byte frame header sync in data with at least a 7 byte
+ * header after it, or of the last 6 bytes (which might hold the start of one)
+ * if there is none */
+size_t dts_find_sync(const unsigned char *data, size_t len, const unsigned char *sync)
+{
+	size_t pos;
+	if (len < 7) return 0;
+	/* leaving out the last 3 bytes, a sync found is followed by 3 more */
+	pos = find_sync(data, len - 3, sync, 4);
+	return pos < len - 3 ? pos : len - 6;
+}
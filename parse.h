@@ -0,0 +1,54 @@
+#ifndef _parse_h
+#define _parse_h
+
+struct write_segment;
+
+/* the per buffer parsing and conversion helpers of the sinks, kept free of
+ * element state so bench-parsers can run them on their own */
+
+struct bitstream
+{
+	guint8 *data;
+	guint8 last;
+	int avail;
+};
+
+void bitstream_init(struct bitstream *bit, const void *buffer, gboolean wr);
+unsigned long bitstream_get(struct bitstream *bit, int bits);
+void bitstream_put(struct bitstream *bit, unsigned long val, int bits);
+
+/* what the sinks need to know of an H.264 sequence parameter set */
+struct h264_sps
+{
+	int profile_idc;
+	int constraint_flags;
+	int level_idc;
+	/* the coded size, and the displayed size after cropping */
+	int width_mbs, height_mbs;
+	int width, height;
+	int crop_left, crop_right, crop_top, crop_bottom;
+	gboolean frame_mbs_only;
+	/* VUI timing, num_units_in_tick counts fields */
+	gboolean timing_info_present;
+	guint32 num_units_in_tick, time_scale;
+	gboolean fixed_frame_rate;
+	/* -1 when the VUI has no bitstream restrictions */
+	int max_num_reorder_frames;
+	int max_dec_frame_buffering;
+};
+
+GstBuffer *h264_startcode_buffer_new(void);
+gboolean h265_hvcc_to_startcode(const unsigned char *hvcc, size_t len, unsigned char *dest, size_t *dest_len, int *nal_len_size);
+int h264_nal_len_to_segments(GstBuffer *buffer, const unsigned char *data, size_t len, int nal_len_size, GstBuffer *startcode, struct write_segment *segments, int max);
+
+gboolean h264_parse_sps(const unsigned char *nal, size_t len, struct h264_sps *sps);
+int h264_sps_framerate(const struct h264_sps *sps);
+
+size_t find_sync(const unsigned char *data, size_t len, const void *pattern, int pattern_len);
+
+int mpeg2_find_group_start(const unsigned char *data, size_t len);
+
+size_t dts_find_hd_sync(const unsigned char *data, size_t len);
+size_t dts_find_sync(const unsigned char *data, size_t len, const unsigned char *sync);
+
+#endif
@@ -0,0 +1,165 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <gst/gst.h>
+
+#include "uring.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(uring_t *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	void *sq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = uring_setup(entries, &params);
+	if (ring->fd < 0) return -1;
+
+	ring->entries = params.sq_entries;
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->sq_size = ring->cq_size = MAX(ring->sq_size, ring->cq_size);
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) goto error;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else
+	{
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) goto error;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) goto error;
+
+	sq = ring->sq_ptr;
+	ring->sq_head = (unsigned*)((char*)sq + params.sq_off.head);
+	ring->sq_tail = (unsigned*)((char*)sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)((char*)sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)sq + params.sq_off.array);
+	ring->cq_head = (unsigned*)((char*)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)((char*)ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + params.cq_off.cqes);
+	ring->sqe_tail = *ring->sq_tail;
+	return 0;
+
+error:
+	{
+		int err = errno;
+		uring_exit(ring);
+		errno = err;
+		return -1;
+	}
+}
+
+void uring_exit(uring_t *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->fd >= 0) close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/* returns a cleared sqe, or NULL when the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+	if (ring->sqe_tail - (unsigned)g_atomic_int_get((gint*)ring->sq_head) >= ring->entries) return NULL;
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* publish the new sqes, and wait for at least wait_nr completions */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr)
+{
+	unsigned tail = *ring->sq_tail;
+	int ret;
+
+	for (; tail != ring->sqe_tail; tail++)
+	{
+		ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	}
+	g_atomic_int_set((gint*)ring->sq_tail, tail);
+
+	do
+	{
+		/* anything the kernel didn't consume yet, also after an interrupted call */
+		unsigned to_submit = tail - (unsigned)g_atomic_int_get((gint*)ring->sq_head);
+		ret = uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+/* get up to max completions, without consuming them */
+unsigned uring_peek_batch(uring_t *ring, struct io_uring_cqe **cqes, unsigned max)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = g_atomic_int_get((gint*)ring->cq_tail);
+	unsigned count = 0;
+
+	for (; head != tail && count < max; head++)
+	{
+		cqes[count++] = &ring->cqes[head & *ring->cq_mask];
+	}
+	return count;
+}
+
+void uring_cq_advance(uring_t *ring, unsigned count)
+{
+	g_atomic_int_set((gint*)ring->cq_head, *ring->cq_head + count);
+}
+
+void uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned events, __u64 user_data)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	/* the 16 bit field works on any endianness and kernel version */
+	sqe->poll_events = events;
+	sqe->user_data = user_data;
+}
+
+void uring_prep_writev(struct io_uring_sqe *sqe, int fd, const struct iovec *iov, int count, __u64 user_data)
+{
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->off = (__u64)-1; /* use the current file position, like writev */
+	sqe->addr = (unsigned long)iov;
+	sqe->len = count;
+	sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, __u64 target, __u64 user_data)
+{
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = user_data;
+}
@@ -0,0 +1,32 @@
+#ifndef _uring_h
+#define _uring_h
+
+#include <linux/io_uring.h>
+
+/* minimal io_uring wrapper on top of the raw system calls */
+typedef struct uring
+{
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	/* sqes handed out by uring_get_sqe, not yet published to the kernel */
+	unsigned sqe_tail;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+void uring_exit(uring_t *ring);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr);
+unsigned uring_peek_batch(uring_t *ring, struct io_uring_cqe **cqes, unsigned max);
+void uring_cq_advance(uring_t *ring, unsigned count);
+
+void uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned events, __u64 user_data);
+void uring_prep_writev(struct io_uring_sqe *sqe, int fd, const struct iovec *iov, int count, __u64 user_data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, __u64 target, __u64 user_data);
+
+#endif